@@ -0,0 +1,84 @@
+/* fastrank.h: C interface to the ranking kernels of the fastrank package
+ *
+ * For C code in other packages that ranks many vectors, such as within a
+ * resampling loop, where going through .Call for each would allocate a
+ * result and dispatch through R each time.  These rank and sort plain
+ * int and double buffers into storage the caller provides.  To use them,
+ * add to the calling package's DESCRIPTION
+ *
+ *     LinkingTo: fastrank
+ *     Imports: fastrank
+ *
+ * and importFrom(fastrank, fastrank) to its NAMESPACE so fastrank is loaded
+ * and its functions registered before they are looked up, then include
+ * this header.
+ *
+ * The values must not be NA or NaN.  Each function returns 0, or -1 if
+ * ties_method or sort_method is unknown.  For FASTRANK_TIES_RANDOM the
+ * caller must bracket calls with GetRNGstate() and PutRNGstate().
+ * sort_method is as for fastrank(), and only 1, 5, 6 and 7 are available
+ * for doubles.  1 is a good choice, a little faster than the default 5
+ * of fastrank() on random values.  Every method takes the median of three
+ * values as its pivot and bounds its recursion, so sorted, reversed and
+ * organ-pipe buffers are safe with any of them.
+ */
+
+#ifndef FASTRANK_H
+#define FASTRANK_H
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#define FASTRANK_TIES_AVERAGE  1
+#define FASTRANK_TIES_FIRST    2
+#define FASTRANK_TIES_RANDOM   3
+#define FASTRANK_TIES_MAX      4
+#define FASTRANK_TIES_MIN      5
+
+/* Rank x[0..n-1] into ranks[0..n-1], using indx[0..n-1] as scratch */
+static R_INLINE int fastrank_rank_int(const int *x, R_xlen_t n,
+                                      int ties_method, int sort_method,
+                                      double *ranks, R_xlen_t *indx) {
+    static int (*fun)(const int *, R_xlen_t, int, int, double *,
+                      R_xlen_t *) = NULL;
+    if (fun == NULL)
+        fun = (int (*)(const int *, R_xlen_t, int, int, double *,
+                       R_xlen_t *)) R_GetCCallable("fastrank",
+                                                   "fastrank_rank_int");
+    return fun(x, n, ties_method, sort_method, ranks, indx);
+}
+
+static R_INLINE int fastrank_rank_double(const double *x, R_xlen_t n,
+                                         int ties_method, int sort_method,
+                                         double *ranks, R_xlen_t *indx) {
+    static int (*fun)(const double *, R_xlen_t, int, int, double *,
+                      R_xlen_t *) = NULL;
+    if (fun == NULL)
+        fun = (int (*)(const double *, R_xlen_t, int, int, double *,
+                       R_xlen_t *)) R_GetCCallable("fastrank",
+                                                   "fastrank_rank_double");
+    return fun(x, n, ties_method, sort_method, ranks, indx);
+}
+
+/* Fill indx[0..n-1] with the 0-based positions of x[0..n-1] in increasing
+ * order of their values; the order of ties is unspecified */
+static R_INLINE int fastrank_sort_int(const int *x, R_xlen_t n,
+                                      int sort_method, R_xlen_t *indx) {
+    static int (*fun)(const int *, R_xlen_t, int, R_xlen_t *) = NULL;
+    if (fun == NULL)
+        fun = (int (*)(const int *, R_xlen_t, int, R_xlen_t *))
+              R_GetCCallable("fastrank", "fastrank_sort_int");
+    return fun(x, n, sort_method, indx);
+}
+
+static R_INLINE int fastrank_sort_double(const double *x, R_xlen_t n,
+                                         int sort_method, R_xlen_t *indx) {
+    static int (*fun)(const double *, R_xlen_t, int, R_xlen_t *) = NULL;
+    if (fun == NULL)
+        fun = (int (*)(const double *, R_xlen_t, int, R_xlen_t *))
+              R_GetCCallable("fastrank", "fastrank_sort_double");
+    return fun(x, n, sort_method, indx);
+}
+
+#endif /* FASTRANK_H */
@@ -0,0 +1,341 @@
+/* fastrank: rank a column of numbers from the command line
+ *
+ * Reads a column of values from a file or stdin, as text (whitespace
+ * separated, NA or NaN for missing) or as raw little-endian 32-bit integers
+ * or doubles, ranks them with the sort kernels and rank walk of the R
+ * package in ../fastrank_sort.h, and writes the ranks to stdout, one per
+ * line or as raw little-endian doubles.  Raw input files are memory mapped
+ * rather than read, and output is written from one large buffer.
+ *
+ *     fastrank [-t ties] [-n last|first|keep] [-f text|int32|double]
+ *              [-o text|double] [-m sort_method] [-s seed] [file]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MY_SIZE_T ptrdiff_t
+#define FR_SORT_ERROR(_msg) { fprintf(stderr, "fastrank: %s\n", _msg); exit(2); }
+#include "../fastrank_sort.h"
+
+#define READ_CHUNK   (1 << 20)
+#define OUT_BUFSIZE  (1 << 16)
+
+typedef enum { TIES_AVERAGE, TIES_FIRST, TIES_RANDOM, TIES_MAX,
+               TIES_MIN } ties_t;
+typedef enum { NA_LAST, NA_FIRST, NA_KEEP } na_t;
+typedef enum { FMT_TEXT, FMT_INT32, FMT_DOUBLE } fmt_t;
+
+static void usage(void) {
+    fprintf(stderr,
+"Usage: fastrank [options] [file]\n"
+"\n"
+"Rank a column of values read from file, or stdin if none is given, and\n"
+"write the ranks to stdout in the order of the input.\n"
+"\n"
+"  -t TIES    ties method: average (default), first, random, max, min\n"
+"  -n NA      NA handling: last (default), first, keep\n"
+"  -f FORMAT  input format: text (default), int32, double; int32 and double\n"
+"             are raw little-endian\n"
+"  -o FORMAT  output format: text (default), double (raw little-endian)\n"
+"  -m METHOD  sort method 1 to 7 as for the R package, default 1; only\n"
+"             1, 5, 6 and 7 are available for text and double input\n"
+"  -s SEED    seed for ties method random\n");
+    exit(2);
+}
+
+static void die(const char *msg, const char *arg) {
+    fprintf(stderr, "fastrank: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+    exit(2);
+}
+
+static int little_endian(void) {
+    const uint16_t one = 1;
+    return *(const unsigned char *) &one == 1;
+}
+
+static void swap_bytes(void *p, const size_t n, const size_t size) {
+    unsigned char *b = (unsigned char *) p;
+    for (size_t i = 0; i < n; ++i, b += size)
+        for (size_t j = 0; j < size / 2; ++j) {
+            unsigned char t = b[j];
+            b[j] = b[size - 1 - j];
+            b[size - 1 - j] = t;
+        }
+}
+
+/* Read all of fp into a buffer, NUL-terminated, returning its length */
+static char * read_all(FILE *fp, size_t *len) {
+    size_t cap = READ_CHUNK, n = 0, m;
+    char *buf = (char *) malloc(cap + 1);
+    if (! buf)
+        die("out of memory", NULL);
+    while ((m = fread(buf + n, 1, cap - n, fp)) > 0) {
+        n += m;
+        if (n == cap) {
+            cap *= 2;
+            if (! (buf = (char *) realloc(buf, cap + 1)))
+                die("out of memory", NULL);
+        }
+    }
+    if (ferror(fp))
+        die("error reading input", NULL);
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+/* Parse whitespace-separated values in buf, NA and NaN are NaN */
+static double * parse_text(char *buf, MY_SIZE_T *n) {
+    MY_SIZE_T cap = 1024, m = 0;
+    double *x = (double *) malloc(cap * sizeof(double));
+    char *p = buf, *end;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+            ++p;
+        if (! *p)
+            break;
+        if (m == cap) {
+            cap *= 2;
+            x = (double *) realloc(x, cap * sizeof(double));
+        }
+        if (! x)
+            die("out of memory", NULL);
+        if (p[0] == 'N' && p[1] == 'A' && (p[2] == '\0' || strchr(" \t\r\n", p[2]))) {
+            x[m++] = NAN;
+            p += 2;
+            continue;
+        }
+        x[m++] = strtod(p, &end);
+        if (end == p || (*end && ! strchr(" \t\r\n", *end))) {
+            end = p;
+            while (*end && ! strchr(" \t\r\n", *end))
+                ++end;
+            *end = '\0';
+            die("not a number", p);
+        }
+        p = end;
+    }
+    *n = m;
+    return x;
+}
+
+/* Write rank r as text, ranks are integers or halves */
+static char * format_rank(char *p, const double r) {
+    if (isnan(r)) {
+        memcpy(p, "NA\n", 3);
+        return p + 3;
+    }
+    uint64_t u = (uint64_t) r;
+    char digits[24];
+    int nd = 0;
+    do {
+        digits[nd++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    while (nd)
+        *p++ = digits[--nd];
+    if (r != floor(r)) {
+        *p++ = '.';
+        *p++ = '5';
+    }
+    *p++ = '\n';
+    return p;
+}
+
+/* The values for the macros of fastrank_sort.h, which take an unused s_x */
+#define CLI_INT32(_s)  ((int32_t *) xi)
+#define CLI_DOUBLE(_s) xd
+#define CLI_ISNA_INT32(_v)  ((_v) == INT32_MIN)
+#define CLI_ISNA_DOUBLE(_v) isnan(_v)
+#undef EQUAL
+#define EQUAL(__A, __B) ((__A) == (__B))
+
+/* Ranks are written by original position, shifted by offset when NAs are
+ * ranked first */
+#define CLI_TO_AT(_j_)          ranks[indx[_j_]]
+#define CLI_TO_STORE(_j_, _r_)  CLI_TO_AT(_j_) = offset + (_r_)
+
+#define CLI_rank(__TYPE, __TCONV) \
+    switch (ties) { \
+    case TIES_AVERAGE: \
+        FR_rank_walk_to(CLI_TO, FR_ties_average, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_FIRST: \
+        FR_stable_runs(__TYPE, __TCONV) \
+        FR_rank_walk_to(CLI_TO, FR_ties_first, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_RANDOM: \
+        FR_rank_walk_to(CLI_TO, FR_ties_random, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_MAX: \
+        FR_rank_walk_to(CLI_TO, FR_ties_max, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_MIN: \
+        FR_rank_walk_to(CLI_TO, FR_ties_min, __TYPE, __TCONV, double, nn) \
+        break; \
+    }
+
+int main(int argc, char *argv[]) {
+    ties_t ties = TIES_AVERAGE;
+    na_t na = NA_LAST;
+    fmt_t in_fmt = FMT_TEXT;
+    int out_double = 0, sort_method = 1, opt;
+    fr_rng_t rng = { (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32) };
+
+    while ((opt = getopt(argc, argv, "t:n:f:o:m:s:h")) != -1) {
+        switch (opt) {
+        case 't':
+            if      (! strcmp(optarg, "average")) ties = TIES_AVERAGE;
+            else if (! strcmp(optarg, "first"))   ties = TIES_FIRST;
+            else if (! strcmp(optarg, "random"))  ties = TIES_RANDOM;
+            else if (! strcmp(optarg, "max"))     ties = TIES_MAX;
+            else if (! strcmp(optarg, "min"))     ties = TIES_MIN;
+            else die("unknown ties method", optarg);
+            break;
+        case 'n':
+            if      (! strcmp(optarg, "last"))  na = NA_LAST;
+            else if (! strcmp(optarg, "first")) na = NA_FIRST;
+            else if (! strcmp(optarg, "keep"))  na = NA_KEEP;
+            else die("unknown NA handling", optarg);
+            break;
+        case 'f':
+            if      (! strcmp(optarg, "text"))   in_fmt = FMT_TEXT;
+            else if (! strcmp(optarg, "int32"))  in_fmt = FMT_INT32;
+            else if (! strcmp(optarg, "double")) in_fmt = FMT_DOUBLE;
+            else die("unknown input format", optarg);
+            break;
+        case 'o':
+            if      (! strcmp(optarg, "text"))   out_double = 0;
+            else if (! strcmp(optarg, "double")) out_double = 1;
+            else die("unknown output format", optarg);
+            break;
+        case 'm':
+            sort_method = atoi(optarg);
+            break;
+        case 's':
+            rng.ctr = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind > 1)
+        usage();
+    const char *file = (optind < argc && strcmp(argv[optind], "-")) ? argv[optind] : NULL;
+
+    /* read the input, mapping raw files */
+    const int le = little_endian();
+    const size_t elsize = (in_fmt == FMT_INT32) ? sizeof(int32_t) : sizeof(double);
+    const void *raw = NULL;
+    double *xd = NULL;
+    MY_SIZE_T n = 0;
+    int mapped = 0;
+    if (in_fmt != FMT_TEXT && file && le) {
+        int fd = open(file, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+            die("unable to open", file);
+        n = (MY_SIZE_T)(st.st_size / elsize);
+        if (n > 0) {
+            raw = mmap(NULL, n * elsize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (raw == MAP_FAILED)
+                die("unable to map", file);
+            mapped = 1;
+        }
+        close(fd);
+    } else {
+        FILE *fp = file ? fopen(file, "rb") : stdin;
+        if (! fp)
+            die("unable to open", file);
+        size_t len;
+        char *buf = read_all(fp, &len);
+        if (file)
+            fclose(fp);
+        if (in_fmt == FMT_TEXT) {
+            xd = parse_text(buf, &n);
+            free(buf);
+        } else {
+            n = (MY_SIZE_T)(len / elsize);
+            if (! le)
+                swap_bytes(buf, n, elsize);
+            raw = buf;
+        }
+    }
+    if (in_fmt == FMT_DOUBLE)
+        xd = (double *) raw;
+    const int32_t *xi = (in_fmt == FMT_INT32) ? (const int32_t *) raw : NULL;
+
+    /* non-NA positions to the front of indx[], NAs to the back in order */
+    MY_SIZE_T *indx = (MY_SIZE_T *) malloc((n + 1) * sizeof(MY_SIZE_T));
+    double *ranks = (double *) malloc((n + 1) * sizeof(double));
+    if (! indx || ! ranks)
+        die("out of memory", NULL);
+    MY_SIZE_T lo = 0, hi = n;
+    if (xi)
+        FR_partition_na(int32_t, CLI_INT32, CLI_ISNA_INT32)
+    else
+        FR_partition_na(double, CLI_DOUBLE, CLI_ISNA_DOUBLE)
+    const MY_SIZE_T nn = lo;
+    for (MY_SIZE_T i = nn, j = n - 1; i < j; ++i, --j)
+        SWAP(MY_SIZE_T, indx[i], indx[j]);
+
+    /* sort and walk the runs of ties as the R package does */
+    const double offset = (na == NA_FIRST) ? (double)(n - nn) : 0.0;
+    fr_tie_stats *tstats = NULL;
+    if (xi) {
+        fr_sort_integer_(xi, indx, nn, sort_method);
+        CLI_rank(int32_t, CLI_INT32)
+    } else {
+        fr_sort_double_(xd, indx, nn, sort_method);
+        CLI_rank(double, CLI_DOUBLE)
+    }
+    for (MY_SIZE_T i = nn; i < n; ++i)
+        ranks[indx[i]] = (na == NA_KEEP)  ? NAN
+                       : (na == NA_FIRST) ? (double)(i - nn + 1)
+                       :                    (double)(i + 1);
+
+    /* write the ranks */
+    if (out_double) {
+        if (! le)
+            swap_bytes(ranks, n, sizeof(double));
+        if (fwrite(ranks, sizeof(double), n, stdout) != (size_t) n)
+            die("error writing output", NULL);
+    } else {
+        char *out = (char *) malloc(OUT_BUFSIZE + 32), *p = out;
+        if (! out)
+            die("out of memory", NULL);
+        for (MY_SIZE_T i = 0; i < n; ++i) {
+            p = format_rank(p, ranks[i]);
+            if (p - out >= OUT_BUFSIZE) {
+                if (fwrite(out, 1, p - out, stdout) != (size_t)(p - out))
+                    die("error writing output", NULL);
+                p = out;
+            }
+        }
+        if (p > out && fwrite(out, 1, p - out, stdout) != (size_t)(p - out))
+            die("error writing output", NULL);
+        free(out);
+    }
+    if (fflush(stdout) != 0)
+        die("error writing output", NULL);
+
+    free(indx);
+    free(ranks);
+    if (in_fmt == FMT_TEXT)
+        free(xd);
+    else if (mapped)
+        munmap((void *) raw, n * elsize);
+    else
+        free((void *) raw);
+    return 0;
+}
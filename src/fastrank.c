@@ -1,16 +1,32 @@
 //TODO: genericify quicksort3way
 //TODO: benchmark it
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
 #include <R.h>
 #include <Rinternals.h>
+#include <Rmath.h>
 #include <R_ext/Rdynload.h>
+#ifdef _OPENMP
+#  include <omp.h>
+#  define FR_THREAD_NUM omp_get_thread_num()
+#else
+#  define FR_THREAD_NUM 0
+#endif
 
 /* include inline debug statements? */
 #define DEBUG 0
 
-/* at what length does quicksort switch to insertion sort? */
-#define QUICKSORT_INSERTION_CUTOFF       20
-#define QUICKSORT3WAY_INSERTION_CUTOFF   20
 
 
 #ifdef LONG_VECTOR_SUPPORT
@@ -21,339 +37,255 @@
 #  define MY_LENGTH length
 #endif
 
+/* offsets into files may pass 2GB, beyond a 32-bit long on Windows */
+#ifdef _WIN32
+#  define FR_FSEEK _fseeki64
+#  define FR_FTELL _ftelli64
+#  define FR_OFF_T int64_t
+#else
+#  define FR_FSEEK fseeko
+#  define FR_FTELL ftello
+#  define FR_OFF_T off_t
+#endif
 
-/* FUNCTION PROTOTYPE DECLARATION *********************************/
-
-static void 
-fr_quicksort_integer_i_(const int * a, MY_SIZE_T indx[], const MY_SIZE_T n);
-
-static void 
-fr_quicksort_double_i_(const double * a, MY_SIZE_T indx[], const MY_SIZE_T n);
 
-static void 
-fr_quicksort_complex_i_(const Rcomplex * a, MY_SIZE_T indx[], const MY_SIZE_T n);
 
-static void
-fr_quicksort3way_integer2_i_(const int * a, MY_SIZE_T indx[], const MY_SIZE_T n, const MY_SIZE_T crit_size);
+/* SORT KERNELS AND RANK WALK *********************************
+ *
+ * The sort kernels and the rank walk are in fastrank_sort.h, where they are
+ * kept free of R so that src/cli can use them too.
+ */
 
-static void
-fr_quicksort3way_double2_i_(const double * a, MY_SIZE_T indx[], const MY_SIZE_T n, const MY_SIZE_T crit_size);
+#define FR_SORT_ERROR(_msg) error(_msg)
+#define FR_TRACE(...) do { if (DEBUG) Rprintf(__VA_ARGS__); } while (0)
+#include "fastrank_sort.h"
 
-static void
-fr_quicksort3way_complex2_i_(const Rcomplex * a, MY_SIZE_T indx[], const MY_SIZE_T n, const MY_SIZE_T crit_size);
 
-SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort);
-SEXP fastrank_num_avg_(SEXP s_x);
-SEXP fastrank_average_(SEXP s_x);
+/* ties methods, shared by every entry accepting 'ties.method' */
+typedef enum { TIES_ERROR = 0, TIES_AVERAGE, TIES_FIRST, TIES_RANDOM,
+               TIES_MAX, TIES_MIN } fr_ties_t;
 
+/* bit64::integer64 vectors are REALSXP holding int64_t, they are given
+ * their own type code by fr_typeof_ */
+#define INT64SXP  1064
+#define FR_INT64(_s) ((int64_t *) REAL(_s))
 
+/* non-const pointer to the CHARSXPs of a character vector, for FR_rank_walk */
+#define FR_STRING_PTR(_s) ((SEXP *) STRING_PTR_RO(_s))
 
-/* FUNCTION REGISTRATION *********************************/
+/* handling of NAs, following 'na.last' for base rank */
+typedef enum { NA_LAST_TRUE = 0, NA_LAST_FALSE, NA_LAST_NA,
+               NA_LAST_KEEP } fr_na_t;
 
-static R_CallMethodDef callMethods[] = {
-    {"fastrank_",         (DL_FUNC) &fastrank_,         3},
-    {"fastrank_num_avg_", (DL_FUNC) &fastrank_num_avg_, 1},
-    {"fastrank_average_", (DL_FUNC) &fastrank_average_, 1},
-    {NULL,                NULL,                         0}
-};
 
-void R_init_fastrank(DllInfo *info) {
-    R_registerRoutines(info, NULL, callMethods, NULL, NULL);
-}
+/* FUNCTION PROTOTYPE DECLARATION *********************************/
 
+static fr_ties_t
+fr_ties_method_(SEXP s_tm);
 
+static fr_na_t
+fr_na_last_(SEXP s_na);
 
-/* SORTING *********************************
- *
- * See also BENCHMARKING.md, which I'll create after I've completed all the
- * benchmarking I intend to do.
- *
- * Quicksort from http://rosettacode.org/wiki/Sorting_algorithms/Quicksort
- * and especially Wikipedia modified two ways:
- *
- * 1. Return a vector of indices and not modify the array of values a[],
- * which requires that the indx[] vector is pre-allocated and filled 0..n-1
- *
- * 2. Use insertion sort for vectors length <= QUICKSORT_INSERTION_CUTOFF
- *
- * Note the papers and resources (esp Sedgwick) I have collected, the LESSER
- * loops should probably be changed to <= to avoid pathological behaviour.
- * Also if a[indx[i]] == a[indx[j]] then they should only be swapped if 
- * j < i.  That might be enough to make it stable...
- *
- * Also note the Dual Pivot Quicksort papers, that might be the truly
- * best way to go.
- */
+static int
+fr_sort_method_(SEXP s_sort);
 
-#define __CPLX_LESSER(__A, __B)  (__A.r < __B.r || (__A.r == __B.r && __A.i < __B.i))
-#define __CPLX_EQUAL(__A, __B)   (__A.r == __B.r && __A.i == __B.i)
+static MY_SIZE_T
+fr_init_index_na_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T n);
 
+static SEXP
+fr_rank_na_(SEXP s_ranks, const MY_SIZE_T indx[], const MY_SIZE_T n,
+            const MY_SIZE_T nn, const fr_na_t na_last);
 
 static void
-fr_quicksort3way_integer_i_(const int *     a, 
-                            MY_SIZE_T       indx[],
-                            const MY_SIZE_T n,
-                            const MY_SIZE_T crit_size) {
-
-#undef EQUAL
-#undef LESSER
-#undef SWAP
-#define EQUAL(__A, __B) (__A == __B)
-#define LESSER(__A, __B) (__A < __B)
-#define SWAP(__T, __A, __B) {__T t = __A; __A = __B; __B = t; }
-    MY_SIZE_T i, j, p, q, k;
-
-    //if (n <= 1) return; 
-    //if (n <= QUICKSORT_INSERTION_CUTOFF) {
-    if (n <= crit_size) {
-        for (i = 1; i < n; ++i) {
-            MY_SIZE_T it = indx[i];
-            for (j = i; j > 0 && LESSER(a[it], a[indx[j - 1]]); --j) {
-                indx[j] = indx[j - 1];
-            }
-            indx[j] = it;
-        }
-        return;
-    }
-
-    int pvt = a[indx[n - 1]];
-
-    for (i = 0; LESSER(a[indx[i]], pvt); ++i);
-    for (j = n - 2; LESSER(pvt, a[indx[j]]) && j > 0; --j);
-    p = 0;
-    q = n - 1;
-    if (i < j) {
-        SWAP(MY_SIZE_T, indx[i], indx[j]);
-        if (EQUAL(a[indx[i]], pvt))
-            SWAP(int, indx[p], indx[i]);
-        if (EQUAL(a[indx[j]], pvt)) {
-            q--;
-            SWAP(MY_SIZE_T, indx[q], indx[j]);
-        }
-        for (;;) {
-            while (++i, LESSER(a[indx[i]], pvt)) ;  
-            while (--j, LESSER(pvt, a[indx[j]]))
-                if (j == 0) break; 
-            if (i >= j) break;
-            SWAP(MY_SIZE_T, indx[i], indx[j]);
-            if (EQUAL(a[indx[i]], pvt)) { 
-                if (p) p++; 
-                SWAP(MY_SIZE_T, indx[p], indx[i]);
-            } 
-            if (EQUAL(a[indx[j]], pvt)) {
-                q--;
-                SWAP(MY_SIZE_T, indx[q], indx[j]);
-            }
-        }
-    }
-    SWAP(MY_SIZE_T, indx[i], indx[n - 1]); 
-    j = i - 1;
-    i++;
-    for (k = 0; k < p; k++, j--)
-        SWAP(MY_SIZE_T, indx[k], indx[j]); 
-    for (k = n - 2; k > q; k--, i++)
-        SWAP(MY_SIZE_T, indx[i], indx[k]);
-    //
-    //printf("n=%2ld  a[0..%2ld]: ", n, n - 1);
-    //for (int t = 0; t < n; ++t) printf("[%2d] %2d  ", t, a[t]);
-    //printf("\n");
-    //
-    fr_quicksort3way_integer_i_(a, indx,     j + 1, crit_size);
-    fr_quicksort3way_integer_i_(a, indx + i, n - i, crit_size);
-}
-
-
-#undef __TYPE
-#undef __LESSER
-#undef __EQUAL
-#undef __CRIT_SIZE
-#undef SWAP
-#define SWAP(__T, __A, __B) { __T t = __A; __A = __B; __B = t; }
-
-#define FR_quicksort3way_body(__TYPE, __LESSER, __EQUAL, __CRIT_SIZE) \
-    MY_SIZE_T i, j, p, q, k; \
-    { \
-    if (n <= crit_size) { \
-        for (i = 1; i < n; ++i) { \
-            MY_SIZE_T it = indx[i]; \
-            for (j = i; j > 0 && __LESSER(a[it], a[indx[j - 1]]); --j) { \
-                indx[j] = indx[j - 1]; \
-            } \
-            indx[j] = it; \
-        } \
-        return; \
-    } \
-    __TYPE pvt = a[indx[n - 1]]; \
-    for (i = 0; __LESSER(a[indx[i]], pvt); ++i); \
-    for (j = n - 2; __LESSER(pvt, a[indx[j]]) && j > 0; --j); \
-    p = 0; \
-    q = n - 1; \
-    if (i < j) { \
-        SWAP(MY_SIZE_T, indx[i], indx[j]); \
-        if (__EQUAL(a[indx[i]], pvt)) {  \
-            SWAP(MY_SIZE_T, indx[p], indx[i]); \
-        }  \
-        if (__EQUAL(a[indx[j]], pvt)) { \
-            q--; \
-            SWAP(MY_SIZE_T, indx[q], indx[j]); \
-        } \
-        for (;;) { \
-            while (++i, __LESSER(a[indx[i]], pvt)) ;   \
-            while (--j, __LESSER(pvt, a[indx[j]])) {   \
-                if (j == 0) break;  \
-            } \
-            if (i >= j) break; \
-            SWAP(MY_SIZE_T, indx[i], indx[j]); \
-            if (__EQUAL(a[indx[i]], pvt)) {  \
-                if (p) p++;  \
-                SWAP(MY_SIZE_T, indx[p], indx[i]); \
-            }  \
-            if (__EQUAL(a[indx[j]], pvt)) { \
-                q--; \
-                SWAP(MY_SIZE_T, indx[q], indx[j]); \
-            } \
-        } \
-    } \
-    SWAP(MY_SIZE_T, indx[i], indx[n - 1]);  \
-    j = i - 1; \
-    i++; \
-    for (k = 0; k < p; k++, j--) { \
-        SWAP(MY_SIZE_T, indx[k], indx[j]);  \
-    } \
-    for (k = n - 2; k > q; k--, i++) { \
-        SWAP(MY_SIZE_T, indx[i], indx[k]); \
-    } \
-    }
+fr_sort_index_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T n, const int sort_method);
 
+static int
+fr_typeof_(SEXP s_x);
 
-#undef LESSER
-#undef EQUAL
-#define LESSER(__A, __B) (__A < __B)
-#define EQUAL(__A, __B) (__A == __B)
 static void
-fr_quicksort3way_integer2_i_(const int *     a, 
-                            MY_SIZE_T       indx[],
-                            const MY_SIZE_T n,
-                            const MY_SIZE_T crit_size) {
-
-    FR_quicksort3way_body(int, LESSER, EQUAL, crit_size);
-
-    fr_quicksort3way_integer2_i_(a, indx,     j + 1, crit_size);
-    fr_quicksort3way_integer2_i_(a, indx + i, n - i, crit_size);
-}
+fr_radixsort_int64_i_(const int64_t * a, MY_SIZE_T indx[], const MY_SIZE_T n);
 
-#undef LESSER
-#undef EQUAL
-#define LESSER(__A, __B) (__A < __B)
-#define EQUAL(__A, __B) (__A == __B)
 static void
-fr_quicksort3way_double2_i_(const double *     a, 
-                            MY_SIZE_T       indx[],
-                            const MY_SIZE_T n,
-                            const MY_SIZE_T crit_size) {
-
-    FR_quicksort3way_body(double, LESSER, EQUAL, crit_size);
-
-    fr_quicksort3way_double2_i_(a, indx,     j + 1, crit_size);
-    fr_quicksort3way_double2_i_(a, indx + i, n - i, crit_size);
-}
+fr_sort_integer_(const int * a, MY_SIZE_T indx[], const MY_SIZE_T n, const int sort_method);
 
-#undef LESSER
-#undef EQUAL
-#define LESSER(__A, __B) __CPLX_LESSER(__A, __B)
-#define EQUAL(__A, __B)  __CPLX_EQUAL(__A, __B)
 static void
-fr_quicksort3way_complex2_i_(const Rcomplex *     a, 
-                             MY_SIZE_T       indx[],
-                             const MY_SIZE_T n,
-                             const MY_SIZE_T crit_size) {
+fr_sort_double_(const double * a, MY_SIZE_T indx[], const MY_SIZE_T n, const int sort_method);
 
-    FR_quicksort3way_body(Rcomplex, LESSER, EQUAL, crit_size);
+static void
+fr_sort_complex_(const Rcomplex * a, const MY_SIZE_T len, MY_SIZE_T indx[],
+                 const MY_SIZE_T n, const int sort_method);
 
-    fr_quicksort3way_complex2_i_(a, indx,     j + 1, crit_size);
-    fr_quicksort3way_complex2_i_(a, indx + i, n - i, crit_size);
-}
+static void
+fr_sort_complex_parts_(const double * re, const double * im, MY_SIZE_T indx[],
+                       const MY_SIZE_T n, const int sort_method);
 
+static SEXP
+fr_rank_runs_(const MY_SIZE_T indx[], const MY_SIZE_T runs[],
+              const MY_SIZE_T nruns, const MY_SIZE_T n,
+              const fr_ties_t ties_method, fr_tie_stats * tstats);
 
+static MY_SIZE_T
+fr_counting_index_(const int * g, MY_SIZE_T indx[], const MY_SIZE_T nn,
+                   const int ng, MY_SIZE_T runs[]);
 
+static SEXP
+fr_rank_codes_(const int * g, MY_SIZE_T indx[], const MY_SIZE_T n,
+               const MY_SIZE_T nn, const int ng, const fr_ties_t ties_method,
+               fr_tie_stats * tstats);
 
-#undef __TYPE
-#undef __LESSER
-#define FR_quicksort_body(__TYPE, __LESSER) \
-    MY_SIZE_T i; /* used as param outside of body */ \
-    { \
-    __TYPE pvt; \
-    MY_SIZE_T j, it; \
-    if (n <= QUICKSORT_INSERTION_CUTOFF) { \
-        for (i = 1; i < n; ++i) { \
-            it = indx[i]; \
-            for (j = i; j > 0 && __LESSER(a[it], a[indx[j - 1]]); --j) { \
-                indx[j] = indx[j - 1]; \
-            } \
-            indx[j] = it; \
-        } \
-        return; \
-    } \
-    pvt = a[indx[n / 2]]; \
-    for (i = 0, j = n - 1; ; i++, j--) { \
-        while (__LESSER(a[indx[i]], pvt)) i++; \
-        while (__LESSER(pvt, a[indx[j]])) j--; \
-        if (i >= j) break; \
-        SWAP(MY_SIZE_T, indx[i], indx[j]); \
-    } \
-    }
+static void
+fr_radixsort_string_(const char ** s, MY_SIZE_T indx[], MY_SIZE_T aux[],
+                     MY_SIZE_T n, size_t d);
 
+static SEXP
+fr_rank_index_(SEXP s_x, const MY_SIZE_T indx[], const MY_SIZE_T n,
+               const MY_SIZE_T nn, const fr_ties_t ties_method,
+               fr_tie_stats * tstats, SEXP s_out);
 
-#undef LESSER
-#undef EQUAL
-#define LESSER(__A, __B) (__A < __B)
-#define EQUAL(__A, __B) (__A == __B)
 static void
-fr_quicksort_integer_i_(const int * a, 
-                        MY_SIZE_T indx[], 
-                        const MY_SIZE_T n) {
+fr_stable_index_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T nn);
 
-    FR_quicksort_body(int, LESSER)
+static SEXP
+fr_rank_string_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T n,
+                const MY_SIZE_T nn, const fr_ties_t ties_method,
+                fr_tie_stats * tstats);
 
-    fr_quicksort_integer_i_(a, indx,     i    );
-    fr_quicksort_integer_i_(a, indx + i, n - i);
-}
+static void 
+fr_quicksort_integer_i_(const int * a, MY_SIZE_T indx[], MY_SIZE_T n);
 
+static void 
+fr_quicksort_double_i_(const double * a, MY_SIZE_T indx[], MY_SIZE_T n);
 
+static void
+fr_quicksort3way_integer2_i_(const int * a, MY_SIZE_T indx[], MY_SIZE_T n, const MY_SIZE_T crit_size);
 
-#undef LESSER
-#undef EQUAL
-#define LESSER(__A, __B) (__A < __B)
-#define EQUAL(__A, __B) (__A == __B)
 static void
-fr_quicksort_double_i_ (const double * a, 
-                        MY_SIZE_T indx[], 
-                        const MY_SIZE_T n) {
+fr_quicksort3way_double2_i_(const double * a, MY_SIZE_T indx[], MY_SIZE_T n, const MY_SIZE_T crit_size);
+
+SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort, SEXP s_na, SEXP s_stats);
+SEXP fastrank_into_(SEXP s_x, SEXP s_out, SEXP s_tm, SEXP s_sort, SEXP s_na);
+SEXP fastrank_factor_(SEXP s_x, SEXP s_tm, SEXP s_levels, SEXP s_na);
+SEXP fastorder_(SEXP s_x, SEXP s_tm, SEXP s_sort, SEXP s_na);
+SEXP fastrank_scores_(SEXP s_x, SEXP s_type, SEXP s_k, SEXP s_tm,
+                      SEXP s_sort);
+SEXP fastrank_wilcox_(SEXP s_x, SEXP s_g, SEXP s_sort);
+SEXP fastrank_kruskal_(SEXP s_x, SEXP s_g, SEXP s_k, SEXP s_sort);
+SEXP fastrank_spearman_(SEXP s_x, SEXP s_sort, SEXP s_threads);
+SEXP fastrank_quantile_normalize_(SEXP s_x, SEXP s_sort, SEXP s_threads);
+SEXP fastrank_sparse_(SEXP s_p, SEXP s_x, SEXP s_n, SEXP s_tm, SEXP s_sort);
+SEXP fastrank_kendall_(SEXP s_x, SEXP s_y, SEXP s_sort);
+SEXP fastrank_multi_(SEXP s_keys, SEXP s_tm, SEXP s_sort, SEXP s_na);
+SEXP fastrank_num_avg_(SEXP s_x);
+SEXP fastrank_average_(SEXP s_x);
+SEXP fastrank_integer_average_(SEXP s_x);
+SEXP fastrank_integer_first_(SEXP s_x);
+SEXP fastrank_integer_random_(SEXP s_x);
+SEXP fastrank_integer_max_(SEXP s_x);
+SEXP fastrank_integer_min_(SEXP s_x);
+SEXP fastrank_numeric_first_(SEXP s_x);
+SEXP fastrank_numeric_random_(SEXP s_x);
+SEXP fastrank_numeric_max_(SEXP s_x);
+SEXP fastrank_numeric_min_(SEXP s_x);
+SEXP fastrank_index_(SEXP s_x, SEXP s_sort);
+SEXP fastrank_index_ranks_(SEXP s_ix, SEXP s_tm, SEXP s_na);
+SEXP fastrank_index_save_(SEXP s_ix, SEXP s_file);
+SEXP fastrank_index_load_(SEXP s_file);
+SEXP fastrank_file_(SEXP s_in, SEXP s_out, SEXP s_type, SEXP s_tm,
+                    SEXP s_na, SEXP s_chunk, SEXP s_sort, SEXP s_tmpdir);
+SEXP fastrank_stats_(void);
+
+static int fr_api_rank_int_(const int * col, const MY_SIZE_T n,
+                            const int ties_method, const int sort_method,
+                            double ranks[], MY_SIZE_T indx[]);
+static int fr_api_rank_double_(const double * col, const MY_SIZE_T n,
+                               const int ties_method, const int sort_method,
+                               double ranks[], MY_SIZE_T indx[]);
+static int fr_api_sort_int_(const int * col, const MY_SIZE_T n,
+                            const int sort_method, MY_SIZE_T indx[]);
+static int fr_api_sort_double_(const double * col, const MY_SIZE_T n,
+                               const int sort_method, MY_SIZE_T indx[]);
 
-    FR_quicksort_body(double, LESSER)
 
-    fr_quicksort_double_i_(a, indx,     i    );
-    fr_quicksort_double_i_(a, indx + i, n - i);
-}
 
+/* FUNCTION REGISTRATION *********************************/
 
+static R_CallMethodDef callMethods[] = {
+    {"fastrank_",         (DL_FUNC) &fastrank_,         5},
+    {"fastrank_into_",    (DL_FUNC) &fastrank_into_,    5},
+    {"fastrank_factor_",  (DL_FUNC) &fastrank_factor_,  4},
+    {"fastorder_",        (DL_FUNC) &fastorder_,        4},
+    {"fastrank_scores_",  (DL_FUNC) &fastrank_scores_,  5},
+    {"fastrank_wilcox_",  (DL_FUNC) &fastrank_wilcox_,  3},
+    {"fastrank_kruskal_", (DL_FUNC) &fastrank_kruskal_, 4},
+    {"fastrank_spearman_", (DL_FUNC) &fastrank_spearman_, 3},
+    {"fastrank_quantile_normalize_", (DL_FUNC) &fastrank_quantile_normalize_, 3},
+    {"fastrank_sparse_",  (DL_FUNC) &fastrank_sparse_,  5},
+    {"fastrank_kendall_", (DL_FUNC) &fastrank_kendall_, 3},
+    {"fastrank_multi_",   (DL_FUNC) &fastrank_multi_,   4},
+    {"fastrank_num_avg_", (DL_FUNC) &fastrank_num_avg_, 1},
+    {"fastrank_average_", (DL_FUNC) &fastrank_average_, 1},
+    {"fastrank_integer_average_", (DL_FUNC) &fastrank_integer_average_, 1},
+    {"fastrank_integer_first_",  (DL_FUNC) &fastrank_integer_first_,  1},
+    {"fastrank_integer_random_", (DL_FUNC) &fastrank_integer_random_, 1},
+    {"fastrank_integer_max_",    (DL_FUNC) &fastrank_integer_max_,    1},
+    {"fastrank_integer_min_",    (DL_FUNC) &fastrank_integer_min_,    1},
+    {"fastrank_numeric_first_",  (DL_FUNC) &fastrank_numeric_first_,  1},
+    {"fastrank_numeric_random_", (DL_FUNC) &fastrank_numeric_random_, 1},
+    {"fastrank_numeric_max_",    (DL_FUNC) &fastrank_numeric_max_,    1},
+    {"fastrank_numeric_min_",    (DL_FUNC) &fastrank_numeric_min_,    1},
+    {"fastrank_index_",       (DL_FUNC) &fastrank_index_,       2},
+    {"fastrank_index_ranks_", (DL_FUNC) &fastrank_index_ranks_, 3},
+    {"fastrank_index_save_",  (DL_FUNC) &fastrank_index_save_,  2},
+    {"fastrank_index_load_",  (DL_FUNC) &fastrank_index_load_,  1},
+    {"fastrank_file_",        (DL_FUNC) &fastrank_file_,        8},
+    {"fastrank_stats_",       (DL_FUNC) &fastrank_stats_,       0},
+    {NULL,                NULL,                         0}
+};
 
-#undef LESSER
-#undef EQUAL
-#define LESSER(__A, __B) __CPLX_LESSER(__A, __B)
-#define EQUAL(__A, __B)  __CPLX_EQUAL(__A, __B)
-static void
-fr_quicksort_complex_i_ (const Rcomplex * a, 
-                        MY_SIZE_T indx[], 
-                        const MY_SIZE_T n) {
+void R_init_fastrank(DllInfo *info) {
+    R_registerRoutines(info, NULL, callMethods, NULL, NULL);
+    /* the C API for other packages, see inst/include/fastrank.h */
+    R_RegisterCCallable("fastrank", "fastrank_rank_int",
+                        (DL_FUNC) &fr_api_rank_int_);
+    R_RegisterCCallable("fastrank", "fastrank_rank_double",
+                        (DL_FUNC) &fr_api_rank_double_);
+    R_RegisterCCallable("fastrank", "fastrank_sort_int",
+                        (DL_FUNC) &fr_api_sort_int_);
+    R_RegisterCCallable("fastrank", "fastrank_sort_double",
+                        (DL_FUNC) &fr_api_sort_double_);
+}
 
-    FR_quicksort_body(Rcomplex, LESSER)
 
-    fr_quicksort_complex_i_(a, indx,     i    );
-    fr_quicksort_complex_i_(a, indx + i, n - i);
-}
 
+/* With FR_INSTRUMENT, fastrank_ also times its phases: index
+ * initialisation, sorting, and rank scatter including NA placement.  The
+ * counters and times are for the most recent call and are returned by
+ * fastrank_stats_().  Counts from OpenMP-parallel callers are not reliable */
+#if FR_INSTRUMENT
+#  include <time.h>
+enum { FR_PHASE_INIT = 0, FR_PHASE_SORT, FR_PHASE_RANK, FR_N_PHASES };
+static double fr_phase_time[FR_N_PHASES];
+static double fr_now_(void) {
+#  ifdef _WIN32
+    return (double) clock() / CLOCKS_PER_SEC;
+#  else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#  endif
+}
+#  define FR_PHASE_START \
+    memset(&fr_sort_counters, 0, sizeof(fr_sort_counters)); \
+    memset(fr_phase_time, 0, sizeof(fr_phase_time)); \
+    double fr_t0 = fr_now_()
+#  define FR_PHASE(_p) { \
+    double fr_t1 = fr_now_(); fr_phase_time[_p] += fr_t1 - fr_t0; fr_t0 = fr_t1; }
+#else
+#  define FR_PHASE_START
+#  define FR_PHASE(_p)
+#endif
 
+#define __CPLX_EQUAL(__A, __B)   (__A.r == __B.r && __A.i == __B.i)
 
 
 
@@ -368,136 +300,129 @@ fr_quicksort_complex_i_ (const Rcomplex * a,
 #undef __RTYPE     /* type of rank returned */
 #undef __R_RTYPE   /* R API type of rank returned */
 #undef __R_TCONV   /* R API conversion for type of rank returned */
+#undef __TO        /* target ranks are written to, see FR_TO_* in fastrank_sort.h */
+
+/* seed from two draws of unif_rand(), within GetRNGstate() and
+ * PutRNGstate() */
+static void fr_rng_seed_(fr_rng_t * rng) {
+    uint64_t hi = (uint64_t)(unif_rand() * 4294967296.0);
+    uint64_t lo = (uint64_t)(unif_rand() * 4294967296.0);
+    rng->ctr = (hi << 32) ^ lo;
+}
 
-/* ties' rank is the minimum of their ranks */
-#define FR_ties_min(__RTYPE, __loc__) \
-    { \
-    __RTYPE rnk = (__RTYPE)(ib + 1); \
-    if (DEBUG) Rprintf("min, ranks[%d .. %d] <- %d   " __loc__ "\n", \
-                       indx[ib], indx[i - 1], rnk); \
-    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
-        ranks[indx[j]] = rnk; \
-    } \
-    }
+/* declare rng for FR_ties_random, seeded from R's RNG stream */
+#define FR_RNG_SEED \
+    fr_rng_t rng; \
+    GetRNGstate(); \
+    fr_rng_seed_(&rng); \
+    PutRNGstate();
 
-/* ties' rank is the maximum of their ranks */
-#define FR_ties_max(__RTYPE, __loc__) \
-    { \
-    __RTYPE rnk = (__RTYPE)i; \
-    if (DEBUG) Rprintf("max, ranks[%d .. %d] <- %d   " __loc__ "\n", \
-                       indx[ib], indx[i - 1], rnk); \
-    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
-        ranks[indx[j]] = rnk; \
-    } \
-    }
 
-/* ties' rank is the average of their ranks */
-#define FR_ties_average(__RTYPE, __loc__) \
-    { \
-    __RTYPE rnk = (i - 1 + ib + 2) / 2.0; \
-    if (DEBUG) Rprintf("average, ranks[%d .. %d] <- %d   " __loc__ "\n", \
-                       indx[ib], indx[i - 1], rnk); \
-    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
-        ranks[indx[j]] = rnk; \
-    } \
-    }
 
-/* ties' rank is consecutive on their order */
-#define FR_ties_first(__RTYPE, __loc__) \
-    { \
-    if (DEBUG) Rprintf("is 'first' only correct when sort is stable?"); \
-    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
-        __RTYPE rnk = (__RTYPE)(j + 1); \
-        if (DEBUG) Rprintf("first, ranks[%d] <- %d  " __loc__ "\n", indx[j], rnk); \
-        ranks[indx[j]] = rnk; \
-    } \
-    }
+/* BLOCKED SCATTER ******************************************
+ *
+ * Writing ranks[indx[j]] in sorted order scatters writes over all of
+ * ranks[], and once that is much larger than the cache nearly every write
+ * misses both cache and TLB.  For nn of FR_SCATTER_BLOCKED_MIN or more, FR_rank
+ * instead writes the ranks to ranks[] in sorted order, then the (position,
+ * rank) pairs are partitioned by destination block in a single radix pass of
+ * at most FR_SCATTER_FANOUT blocks, and each block is written back to
+ * ranks[] in turn, so its writes stay within cache.  This costs 4 +
+ * sizeof(rank) bytes of scratch per value, released when done.  The
+ * threshold is where ranks[] outgrows a typical last-level cache; below it
+ * the extra passes cost more than the misses they save.
+ */
 
-/* ties' rank is a random shuffling of their order */
-#define FR_ties_random(__RTYPE, __loc__) \
-    { \
-    MY_SIZE_T tn = i - ib; \
-    MY_SIZE_T* t = (MY_SIZE_T*) R_alloc(tn, sizeof(MY_SIZE_T)); \
-    MY_SIZE_T j; \
-    for (j = 0; j < tn; ++j) \
-        t[j] = j; \
-    for (j = ib; j < i - 1; ++j) { \
-        MY_SIZE_T k = (MY_SIZE_T)(tn * unif_rand()); \
-        __RTYPE rnk = (__RTYPE)(t[k] + ib + 1); \
-        if (DEBUG) Rprintf("random, rank[%d] <- %d  " __loc__ "\n", indx[j], rnk); \
-        ranks[indx[j]] = rnk; \
-        t[k] = t[--tn]; \
+#define FR_SCATTER_BLOCKED_MIN  ((MY_SIZE_T) 1 << 23)
+#define FR_SCATTER_FANOUT       1024
+#define FR_SCATTER_MIN_SHIFT    15
+/* offsets within a block are 32 bits */
+#define FR_SCATTER_BLOCKED_MAX  ((int64_t) FR_SCATTER_FANOUT << 32)
+
+#define FR_scatter_blocked(__RTYPE) \
+static void fr_scatter_##__RTYPE##_blocked_(__RTYPE ranks[], \
+                                            const MY_SIZE_T indx[], \
+                                            const MY_SIZE_T nn, \
+                                            const MY_SIZE_T n) { \
+    const void *vmax = vmaxget(); \
+    int shift = FR_SCATTER_MIN_SHIFT; \
+    while ((n >> shift) >= FR_SCATTER_FANOUT) \
+        ++shift; \
+    const MY_SIZE_T nb = (n >> shift) + 1; \
+    const MY_SIZE_T mask = ((MY_SIZE_T) 1 << shift) - 1; \
+    MY_SIZE_T *start = (MY_SIZE_T *) R_alloc(nb + 1, sizeof(MY_SIZE_T)); \
+    uint32_t *off = (uint32_t *) R_alloc(nn, sizeof(uint32_t)); \
+    __RTYPE *val = (__RTYPE *) R_alloc(nn, sizeof(__RTYPE)); \
+    MY_SIZE_T b, j, k; \
+    memset(start, 0, (nb + 1) * sizeof(MY_SIZE_T)); \
+    for (j = 0; j < nn; ++j) \
+        ++start[(indx[j] >> shift) + 1]; \
+    for (b = 1; b < nb; ++b) \
+        start[b] += start[b - 1]; \
+    /* start[b] is where block b begins, and is advanced to where it ends */ \
+    for (j = 0; j < nn; ++j) { \
+        k = start[indx[j] >> shift]++; \
+        off[k] = (uint32_t)(indx[j] & mask); \
+        val[k] = ranks[j]; \
     } \
-    __RTYPE rnk = (__RTYPE)(t[0] + ib + 1); \
-    if (DEBUG) Rprintf("random, rank[%d] <- %d  " __loc__ "\n", indx[j], rnk); \
-    ranks[indx[j]] = rnk; \
-    }
-
-
-
-#define XI(_i_) x[indx[_i_]]   /* accessing the vector through the index */
+    for (b = 0, k = 0; b < nb; ++b) { \
+        __RTYPE *dst = ranks + (b << shift); \
+        for ( ; k < start[b]; ++k) \
+            dst[off[k]] = val[k]; \
+    } \
+    vmaxset(vmax); \
+}
 
+FR_scatter_blocked(int)
+FR_scatter_blocked(double)
 
+/* the rank vector is allocated with FR_ALLOC_RANKS, which is redefined where
+ * ranks may be written into a vector from the caller */
+#define FR_ALLOC_RANKS(__R_RTYPE) allocVector(__R_RTYPE, n)
 
 #define FR_rank(__TIES__, __TYPE, __TCONV, __RTYPE, __R_RTYPE, __R_TCONV) \
     { \
-    s_ranks = PROTECT(allocVector(__R_RTYPE, n)); \
+    s_ranks = PROTECT(FR_ALLOC_RANKS(__R_RTYPE)); \
     __RTYPE* ranks = __R_TCONV(s_ranks); \
     if (DEBUG) Rprintf("address of ranks = 0x%p\n", ranks); \
-    __TYPE* x = __TCONV(s_x); \
-    MY_SIZE_T ib = 0; \
-    __TYPE b = XI(0); \
-    MY_SIZE_T i; \
-    if (DEBUG) Rprintf("ib = %d\n", ib); \
-    for (i = 1; i < n; ++i) { \
-        if (! EQUAL(XI(i), b)) { \
-            if (DEBUG) Rprintf("XI(%d) %.1f != b %.1f\n", i, (double)XI(i), (double)b); \
-            if (ib < i - 1) { \
-                __TIES__(__RTYPE, "MID") \
-            } else { \
-                if (DEBUG) \
-                    Rprintf("ranks[%d] <- %.1f  MID\n", indx[ib], (double)(ib + 1)); \
-                ranks[indx[ib]] = (__RTYPE)(ib + 1); \
-            } \
-            b = XI(i); \
-            ib = i; \
-            if (DEBUG) Rprintf("ib = %d\n", ib); \
-        } \
-    } \
-    if (ib == i - 1) {\
-        if (DEBUG) Rprintf("ranks[%d] <- %.1f  FIN\n", ib, (double)(indx[ib])); \
-        ranks[indx[ib]] = (__RTYPE)(i); \
+    if (nn < FR_SCATTER_BLOCKED_MIN || n > FR_SCATTER_BLOCKED_MAX) { \
+        FR_rank_walk_to(FR_TO_RANKS, __TIES__, __TYPE, __TCONV, __RTYPE, nn) \
     } else { \
-        __TIES__(__RTYPE, "FIN") \
+        FR_rank_walk_to(FR_TO_SORTED, __TIES__, __TYPE, __TCONV, __RTYPE, nn) \
+        fr_scatter_##__RTYPE##_blocked_(ranks, indx, nn, n); \
     } \
     }
 
 
 
-/* General ranking (no characters), called from fastrank() wrapper */
-SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort) {
+/* Rank from known run boundaries: runs[r] is the start in indx[] of the r-th
+ * run of equal values, runs[nruns] == n.  No values need to be compared */
+#define FR_rank_runs(__TIES__, __RTYPE, __R_RTYPE, __R_TCONV) \
+    { \
+    s_ranks = PROTECT(allocVector(__R_RTYPE, n)); \
+    __RTYPE* ranks = __R_TCONV(s_ranks); \
+    for (MY_SIZE_T r = 0; r < nruns; ++r) { \
+        MY_SIZE_T ib = runs[r]; \
+        MY_SIZE_T i = runs[r + 1]; \
+        if (ib < i - 1) { \
+            __TIES__(__RTYPE, FR_TO_RANKS, "RUN") \
+            FR_tie_stat(i - ib) \
+        } else { \
+            FR_TO_RANKS_STORE(ib, (__RTYPE)(ib + 1)); \
+        } \
+    } \
+    }
 
-    if (TYPEOF(s_x) == CPLXSXP)
-        Rprintf("'complex' value support is experimental");
-    else if (TYPEOF(s_x) == STRSXP)
-        error("'character' values not allowed");
-    else if (TYPEOF(s_x) != REALSXP && TYPEOF(s_x) != INTSXP && TYPEOF(s_x) != LGLSXP)
-        error("type of 'x' not supported");
 
-    int sort_method = INTEGER(s_sort)[0];
-    //if (sort_method < 1 || sort_method > 7)
-    //    error("'sort.method' must be between 1 and 4");
 
-    MY_SIZE_T n = MY_LENGTH(s_x);
-    if (DEBUG) Rprintf("length of s_x = %d\n", n);
+/* Decode 'ties.method', shared by all entries accepting it */
+static fr_ties_t fr_ties_method_(SEXP s_tm) {
 
-    /* Now process ties.method */
     if (TYPEOF(s_tm) != STRSXP)
         error("ties.method must be \"average\", \"first\", \"random\", \"max\", or \"min\"");
     const char* tm = CHAR(STRING_ELT(s_tm, 0));
 
-    enum { TIES_ERROR = 0, TIES_AVERAGE, TIES_FIRST, TIES_RANDOM,
-           TIES_MAX, TIES_MIN } ties_method;
+    fr_ties_t ties_method;
 
     /* method 1, this is a bit faster, like 0.2% */
     switch(tm[0]) {
@@ -537,135 +462,764 @@ SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort) {
     }
 #endif
 
-    /* allocate index and fill with 0..n-1 */
-    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
-    for (MY_SIZE_T i = 0; i < n; ++i) indx[i] = i;
+    return ties_method;
+}
 
-    if (DEBUG) {
-        Rprintf("sort return indx:\n");
-        for (int i = 0; i < n; ++i) Rprintf("%d ", indx[i]);
-        Rprintf("\n");
+
+
+/* Decode 'na.last', which is TRUE, FALSE, NA or "keep" as for base rank */
+static fr_na_t fr_na_last_(SEXP s_na) {
+    if (TYPEOF(s_na) == LGLSXP && LENGTH(s_na) == 1) {
+        int na_last = LOGICAL(s_na)[0];
+        if (na_last == NA_LOGICAL)
+            return NA_LAST_NA;
+        return na_last ? NA_LAST_TRUE : NA_LAST_FALSE;
     }
+    if (TYPEOF(s_na) == STRSXP && LENGTH(s_na) == 1
+        && ! strcmp(CHAR(STRING_ELT(s_na, 0)), "keep"))
+        return NA_LAST_KEEP;
+    error("'na.last' must be TRUE, FALSE, NA or \"keep\"");
+    return NA_LAST_TRUE;  /* not reached */
+}
 
-    /* sort indices!!  probably should move this to within the big switch */
-    switch (TYPEOF(s_x)) {
+
+
+/* Decode 'sort.method', which may be integer or numeric.  Whether a method
+ * is available for the type being sorted is checked by the sort kernels */
+static int fr_sort_method_(SEXP s_sort) {
+    int sort_method = asInteger(s_sort);
+    if (sort_method == NA_INTEGER || sort_method < 1 || sort_method > 7)
+        error("'sort.method' must be an integer from 1 to 7");
+    return sort_method;
+}
+
+
+
+/* Fill indx[] with 0..n-1, partitioning the positions of NAs and NaNs to the
+ * end so only the first nn entries are sorted and ranked.  Non-NA positions
+ * are filled from the front and NA positions from the back, then the NA
+ * positions are reversed so they are in order of appearance.  Returns nn,
+ * the number of non-NA values */
+
+#define FR_ISNA_INT(_x)   (_x == NA_INTEGER)
+#define FR_ISNA_REAL(_x)  ISNAN(_x)
+#define FR_ISNA_CPLX(_x)  (ISNAN(_x.r) || ISNAN(_x.i))
+#define FR_ISNA_STR(_x)   (_x == NA_STRING)
+#define FR_ISNA_INT64(_x) (_x == INT64_MIN)  /* bit64's NA_integer64_ */
+
+static MY_SIZE_T fr_init_index_na_(SEXP s_x, MY_SIZE_T indx[],
+                                   const MY_SIZE_T n) {
+    MY_SIZE_T lo = 0, hi = n;
+    switch (fr_typeof_(s_x)) {
     case LGLSXP:
     case INTSXP:
-        switch(sort_method) {
-        case 1:
-            fr_quicksort_integer_i_(INTEGER(s_x), indx, n);
-            break;
-        case 2:
-            fr_quicksort3way_integer_i_(INTEGER(s_x), indx, n, 1);
-            break;
-        case 3:
-            fr_quicksort3way_integer_i_(INTEGER(s_x), indx, n, 10);
-            break;
-        case 4:
-            fr_quicksort3way_integer_i_(INTEGER(s_x), indx, n, 20);
-            break;
-        case 5:
-            fr_quicksort3way_integer2_i_(INTEGER(s_x), indx, n, 1);
-            break;
-        case 6:
-            fr_quicksort3way_integer2_i_(INTEGER(s_x), indx, n, 10);
-            break;
-        case 7:
-            fr_quicksort3way_integer2_i_(INTEGER(s_x), indx, n, 20);
-            break;
-        default:
-            error("unknown sort_method for INTSXP and LGLSXP");
-            break;
-        }
+        FR_partition_na(int, INTEGER, FR_ISNA_INT)
         break;
     case REALSXP:
-        switch(sort_method) {
-        case 1:
-            fr_quicksort_double_i_(REAL(s_x), indx, n);
-            break;
-        case 5:
-            fr_quicksort3way_double2_i_(REAL(s_x), indx, n, 1);
-            break;
-        case 6:
-            fr_quicksort3way_double2_i_(REAL(s_x), indx, n, 10);
-            break;
-        case 7:
-            fr_quicksort3way_double2_i_(REAL(s_x), indx, n, 20);
-            break;
-        default:
-            error("unknown sort_method for REALSXP");
-            break;
-        }
+        FR_partition_na(double, REAL, FR_ISNA_REAL)
         break;
     case CPLXSXP:
-        switch(sort_method) {
-        case 1:
-            fr_quicksort_complex_i_(COMPLEX(s_x), indx, n);
-            break;
-        case 5:
-            fr_quicksort3way_complex2_i_(COMPLEX(s_x), indx, n, 1);
-            break;
-        case 6:
-            fr_quicksort3way_complex2_i_(COMPLEX(s_x), indx, n, 10);
-            break;
-        case 7:
-            fr_quicksort3way_complex2_i_(COMPLEX(s_x), indx, n, 20);
-            break;
-        default:
-            error("unknown sort_method for CPLXSXP");
-            break;
-        }
+        FR_partition_na(Rcomplex, COMPLEX, FR_ISNA_CPLX)
+        break;
+    case STRSXP:
+        FR_partition_na(SEXP, STRING_PTR_RO, FR_ISNA_STR)
+        break;
+    case INT64SXP:
+        FR_partition_na(int64_t, FR_INT64, FR_ISNA_INT64)
         break;
     default:
         error("Unsupported type for 'x'");
         break;
     }
+    for (MY_SIZE_T j = n - 1; hi < j; ++hi, --j)
+        SWAP(MY_SIZE_T, indx[hi], indx[j]);
+    return lo;
+}
 
-    /* indx[i] holds the index of the value in s_x that belongs in position i,
-     * e.g., indx[0] holds the position in s_x of the lowest value */
 
-    if (DEBUG) {
-        Rprintf("sort return indx:\n");
-        for (int i = 0; i < n; ++i) Rprintf("%d ", indx[i]);
-        Rprintf("\n");
+
+/* Assign ranks to the NAs in indx[nn..n-1] following na_last, after the
+ * first nn entries have been ranked 1..nn.  For NA_LAST_NA a new vector
+ * holding only the ranks of non-NA values is returned, otherwise s_ranks is
+ * returned */
+
+#define FR_rank_na(__RTYPE, __R_RTYPE, __R_TCONV, __NA) \
+    { \
+    __RTYPE* ranks = __R_TCONV(s_ranks); \
+    switch(na_last) { \
+    case NA_LAST_TRUE: \
+        for (MY_SIZE_T j = nn; j < n; ++j) \
+            ranks[indx[j]] = (__RTYPE)(j + 1); \
+        break; \
+    case NA_LAST_FALSE: \
+        for (MY_SIZE_T j = 0; j < nn; ++j) \
+            ranks[indx[j]] += (__RTYPE)(n - nn); \
+        for (MY_SIZE_T j = nn; j < n; ++j) \
+            ranks[indx[j]] = (__RTYPE)(j - nn + 1); \
+        break; \
+    case NA_LAST_KEEP: \
+        for (MY_SIZE_T j = nn; j < n; ++j) \
+            ranks[indx[j]] = __NA; \
+        break; \
+    case NA_LAST_NA: \
+        { \
+        /* NA positions in indx[nn..n-1] are increasing, skip them */ \
+        s_ranks = allocVector(__R_RTYPE, nn); \
+        __RTYPE* r = __R_TCONV(s_ranks); \
+        MY_SIZE_T k = nn, o = 0; \
+        for (MY_SIZE_T j = 0; j < n; ++j) { \
+            if (k < n && indx[k] == j) ++k; \
+            else r[o++] = ranks[j]; \
+        } \
+        } \
+        break; \
+    } \
     }
 
-    SEXP s_ranks = NULL;  /* return value, allocated below */
+static SEXP fr_rank_na_(SEXP s_ranks, const MY_SIZE_T indx[],
+                        const MY_SIZE_T n, const MY_SIZE_T nn,
+                        const fr_na_t na_last) {
+    if (nn == n)
+        return s_ranks;
+    if (TYPEOF(s_ranks) == REALSXP)
+        FR_rank_na(double, REALSXP, REAL, NA_REAL)
+    else
+        FR_rank_na(int, INTSXP, INTEGER, NA_INTEGER)
+    return s_ranks;
+}
 
-    /* now decide which way to go and do it! */
 
-    switch (TYPEOF(s_x)) {
+
+/* TYPEOF, except bit64::integer64 vectors are INT64SXP */
+static int fr_typeof_(SEXP s_x) {
+    if (TYPEOF(s_x) == REALSXP && OBJECT(s_x) && inherits(s_x, "integer64"))
+        return INT64SXP;
+    return TYPEOF(s_x);
+}
+
+
+
+/* LSD radix sort of indx[] by the 64-bit integers a[indx[i]], in eight
+ * passes of one byte each over keys with the sign bit flipped so they order
+ * as unsigned.  The keys travel with the index so each pass reads them
+ * sequentially, and passes in which all keys have the same byte are
+ * skipped, so values of limited range take only a few passes.  The sort is
+ * stable */
+static void fr_radixsort_int64_i_(const int64_t * a, MY_SIZE_T indx[],
+                                  const MY_SIZE_T n) {
+    if (n <= 1)
+        return;
+    uint64_t *k = (uint64_t *) R_alloc(n, sizeof(uint64_t));
+    uint64_t *k2 = (uint64_t *) R_alloc(n, sizeof(uint64_t));
+    MY_SIZE_T *aux = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T count[8][256];
+    memset(count, 0, sizeof(count));
+    for (MY_SIZE_T i = 0; i < n; ++i) {
+        uint64_t key = (uint64_t) a[indx[i]] ^ 0x8000000000000000ULL;
+        k[i] = key;
+        for (int b = 0; b < 8; ++b)
+            ++count[b][(key >> (8 * b)) & 0xFF];
+    }
+    MY_SIZE_T *src = indx, *dst = aux;
+    uint64_t *ksrc = k, *kdst = k2;
+    for (int b = 0; b < 8; ++b) {
+        int shift = 8 * b;
+        if (count[b][(ksrc[0] >> shift) & 0xFF] == n)
+            continue;
+        MY_SIZE_T off = 0;
+        for (int d = 0; d < 256; ++d) {
+            MY_SIZE_T c = count[b][d];
+            count[b][d] = off;
+            off += c;
+        }
+        for (MY_SIZE_T i = 0; i < n; ++i) {
+            MY_SIZE_T pos = count[b][(ksrc[i] >> shift) & 0xFF]++;
+            dst[pos] = src[i];
+            kdst[pos] = ksrc[i];
+        }
+        SWAP(MY_SIZE_T *, src, dst);
+        SWAP(uint64_t *, ksrc, kdst);
+    }
+    if (src != indx)
+        memcpy(indx, src, n * sizeof(MY_SIZE_T));
+}
+
+
+
+/* Sort indx[] by the values in s_x, using the sort routine chosen by
+ * sort_method */
+static void fr_sort_index_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T n,
+                           const int sort_method) {
+
+    switch (fr_typeof_(s_x)) {
     case LGLSXP:
     case INTSXP:
-        {
-#define EQUAL(_x, _y) (_x == _y)
-#define TYPE int
-#define TCONV INTEGER
-            switch(ties_method) {
-            case TIES_AVERAGE:
-                FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
-                break;
-            case TIES_FIRST:
-                FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
-                break;
-                break;
-            case TIES_RANDOM:
-                GetRNGstate();
-                FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
-                PutRNGstate();
-                break;
-            case TIES_MAX:
-                FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
-                break;
-            case TIES_MIN:
-                FR_rank(FR_ties_min, TYPE, TCONV, int, INTSXP, INTEGER)
-                break;
-            default:
-                error("unknown 'ties.method', should never be reached");
-                break;
-            }
-#undef EQUAL
-#undef TYPE
+        fr_sort_integer_(INTEGER(s_x), indx, n, sort_method);
+        break;
+    case REALSXP:
+        fr_sort_double_(REAL(s_x), indx, n, sort_method);
+        break;
+    case CPLXSXP:
+        fr_sort_complex_(COMPLEX(s_x), MY_LENGTH(s_x), indx, n, sort_method);
+        break;
+    case INT64SXP:
+        /* always radix sorted */
+        fr_radixsort_int64_i_(FR_INT64(s_x), indx, n);
+        break;
+    default:
+        error("Unsupported type for 'x'");
+        break;
+    }
+}
+
+/* Complex values sort by real and then imaginary part, as for base sort.
+ * The parts are split into separate arrays so the double kernels compare
+ * plain doubles in contiguous memory: indx[] is sorted on the real parts,
+ * and then each run of equal real parts is sorted on the imaginary parts.
+ * len is the length of a[], of which the n positions in indx[] are sorted.
+ * Callers sorting many parts of the same vector, such as runs of ties on
+ * earlier keys, split it once and call fr_sort_complex_parts_ instead */
+static void fr_sort_complex_(const Rcomplex * a, const MY_SIZE_T len,
+                             MY_SIZE_T indx[], const MY_SIZE_T n,
+                             const int sort_method) {
+    double *re = (double *) R_alloc(len, sizeof(double));
+    double *im = (double *) R_alloc(len, sizeof(double));
+    for (MY_SIZE_T i = 0; i < len; ++i) {
+        re[i] = a[i].r;
+        im[i] = a[i].i;
+    }
+    fr_sort_complex_parts_(re, im, indx, n, sort_method);
+}
+
+static void fr_sort_complex_parts_(const double * re, const double * im,
+                                   MY_SIZE_T indx[], const MY_SIZE_T n,
+                                   const int sort_method) {
+    if (sort_method != 1 && (sort_method < 5 || sort_method > 7))
+        error("unknown sort_method for CPLXSXP");
+    fr_sort_double_(re, indx, n, sort_method);
+    MY_SIZE_T ib = 0;
+    for (MY_SIZE_T i = 1; i <= n; ++i) {
+        if (i == n || re[indx[i]] != re[indx[ib]]) {
+            if (i - ib > 1)
+                fr_sort_double_(im, indx + ib, i - ib, sort_method);
+            ib = i;
+        }
+    }
+}
+
+
+
+/* COUNTING PATH ******************************************
+ *
+ * When each value can be given a dense integer code 0..ng-1 in rank order,
+ * as for factors or for character vectors after their unique values are
+ * sorted, no values need to be compared at all.  For "average", "max" and
+ * "min" the rank of each code follows from a histogram of the codes and its
+ * prefix sum, and ranks are assigned in order of position.  For "first" and
+ * "random" the sort index is a stable counting sort by code, and the runs of
+ * ties are the counts.
+ */
+
+/* Assign ranks from known run boundaries, see FR_rank_runs.  Returns the
+ * unPROTECTed rank vector of length n */
+static SEXP fr_rank_runs_(const MY_SIZE_T indx[], const MY_SIZE_T runs[],
+                          const MY_SIZE_T nruns, const MY_SIZE_T n,
+                          const fr_ties_t ties_method,
+                          fr_tie_stats * tstats) {
+
+    SEXP s_ranks = NULL;  /* return value, allocated below */
+
+    switch(ties_method) {
+    case TIES_AVERAGE:
+        FR_rank_runs(FR_ties_average, double, REALSXP, REAL)
+        break;
+    case TIES_FIRST:
+        FR_rank_runs(FR_ties_first, int, INTSXP, INTEGER)
+        break;
+    case TIES_RANDOM: {
+        FR_RNG_SEED
+        FR_rank_runs(FR_ties_random, int, INTSXP, INTEGER)
+        break;
+    }
+    case TIES_MAX:
+        FR_rank_runs(FR_ties_max, int, INTSXP, INTEGER)
+        break;
+    case TIES_MIN:
+        FR_rank_runs(FR_ties_min, int, INTSXP, INTEGER)
+        break;
+    default:
+        error("unknown 'ties.method', should never be reached");
+        break;
+    }
+
+    UNPROTECT(1);
+    return s_ranks;
+}
+
+
+
+/* Stable counting sort of the first nn entries of indx[] by their codes
+ * g[indx[i]], which are in 0..ng-1.  The starts of the nonempty runs of equal
+ * codes are written to runs[], which must have room for ng + 1 entries, and
+ * the number of nonempty runs is returned, with runs[nruns] == nn */
+static MY_SIZE_T fr_counting_index_(const int * g, MY_SIZE_T indx[],
+                                    const MY_SIZE_T nn, const int ng,
+                                    MY_SIZE_T runs[]) {
+    MY_SIZE_T *count = (MY_SIZE_T *) R_alloc(ng + 1, sizeof(MY_SIZE_T));
+    MY_SIZE_T *aux = (MY_SIZE_T *) R_alloc(nn, sizeof(MY_SIZE_T));
+    memset(count, 0, (ng + 1) * sizeof(MY_SIZE_T));
+    for (MY_SIZE_T i = 0; i < nn; ++i) {
+        int c = g[indx[i]];
+        if (c < 0 || c >= ng)
+            error("code %d of 'x' out of range", c);
+        ++count[c + 1];
+    }
+    MY_SIZE_T nruns = 0;
+    for (int c = 0; c < ng; ++c) {
+        if (count[c + 1] > 0)
+            runs[nruns++] = count[c];
+        count[c + 1] += count[c];
+    }
+    runs[nruns] = nn;
+    for (MY_SIZE_T i = 0; i < nn; ++i)
+        aux[count[g[indx[i]]]++] = indx[i];
+    memcpy(indx, aux, nn * sizeof(MY_SIZE_T));
+    return nruns;
+}
+
+
+
+/* Rank from codes g[i] in 0..ng-1, or negative for NA.  The first nn
+ * entries of indx[] hold the positions of the non-NA values, and are only
+ * used (and counting-sorted) for "first" and "random".  Returns the
+ * unPROTECTed rank vector of length n, with NAs not yet ranked */
+
+#define FR_rank_codes(__RTYPE, __R_RTYPE, __R_TCONV, __RNK) \
+    { \
+    __RTYPE *rk = (__RTYPE *) R_alloc(ng, sizeof(__RTYPE)); \
+    for (int c = 0; c < ng; ++c) \
+        rk[c] = (__RTYPE)(__RNK); \
+    s_ranks = PROTECT(allocVector(__R_RTYPE, n)); \
+    __RTYPE* ranks = __R_TCONV(s_ranks); \
+    for (MY_SIZE_T i = 0; i < n; ++i) { \
+        if (g[i] >= 0) ranks[i] = rk[g[i]]; \
+    } \
+    }
+
+static SEXP fr_rank_codes_(const int * g, MY_SIZE_T indx[],
+                           const MY_SIZE_T n, const MY_SIZE_T nn,
+                           const int ng, const fr_ties_t ties_method,
+                           fr_tie_stats * tstats) {
+
+    if (ties_method == TIES_FIRST || ties_method == TIES_RANDOM) {
+        MY_SIZE_T *runs = (MY_SIZE_T *) R_alloc(ng + 1, sizeof(MY_SIZE_T));
+        MY_SIZE_T nruns = fr_counting_index_(g, indx, nn, ng, runs);
+        return fr_rank_runs_(indx, runs, nruns, n, ties_method, tstats);
+    }
+
+    /* histogram, then count[c] is the number of values with code < c */
+    MY_SIZE_T *count = (MY_SIZE_T *) R_alloc(ng + 1, sizeof(MY_SIZE_T));
+    memset(count, 0, (ng + 1) * sizeof(MY_SIZE_T));
+    for (MY_SIZE_T i = 0; i < n; ++i) {
+        int c = g[i];
+        if (c < 0)
+            continue;
+        if (c >= ng)
+            error("code %d of 'x' out of range", c);
+        ++count[c + 1];
+    }
+    for (int c = 0; c < ng; ++c) {
+        if (count[c + 1] > 1)
+            FR_tie_stat(count[c + 1])
+        count[c + 1] += count[c];
+    }
+
+    SEXP s_ranks = NULL;  /* return value, allocated below */
+
+    switch(ties_method) {
+    case TIES_AVERAGE:
+        FR_rank_codes(double, REALSXP, REAL, (count[c] + 1 + count[c + 1]) / 2.0)
+        break;
+    case TIES_MAX:
+        FR_rank_codes(int, INTSXP, INTEGER, count[c + 1])
+        break;
+    case TIES_MIN:
+        FR_rank_codes(int, INTSXP, INTEGER, count[c] + 1)
+        break;
+    default:
+        error("unknown 'ties.method', should never be reached");
+        break;
+    }
+
+    UNPROTECT(1);
+    return s_ranks;
+}
+
+
+
+/* CHARACTER VECTORS ******************************************
+ *
+ * Strings are ranked in C-locale (byte) order, which is not necessarily the
+ * order base rank gives, as that follows the collation of the current
+ * locale.  Strings are compared as UTF-8, so the order is by Unicode code
+ * point.
+ *
+ * Because of R's global string cache, equal strings are nearly always the
+ * same CHARSXP, so the CHARSXPs are first reduced to their unique pointers
+ * with a hash table.  Only the unique strings are sorted, with an MSD radix
+ * sort on their bytes, and each value is then ranked on the counting path
+ * using the rank of its unique string as its code.
+ */
+
+#define STRING_INSERTION_CUTOFF  16
+
+static SEXP
+fr_rank_codes_(const int * g, MY_SIZE_T indx[], const MY_SIZE_T n,
+               const MY_SIZE_T nn, const int ng, const fr_ties_t ties_method,
+               fr_tie_stats * tstats);
+
+/* MSD radix sort of indx[] by the strings s[indx[i]], all of which are known
+ * to be equal in their first d bytes.  aux[] is scratch of length n.  Only
+ * the buckets other than the largest are sorted by recursion, and the
+ * largest by the next pass of the outer loop, so each recursion is into at
+ * most half the strings and the depth is at most log2(n), however long the
+ * common prefixes, e.g., "a", "aa", "aaa", ... */
+static void
+fr_radixsort_string_(const char ** s,
+                     MY_SIZE_T       indx[],
+                     MY_SIZE_T       aux[],
+                     MY_SIZE_T       n,
+                     size_t          d) {
+    MY_SIZE_T i, j;
+    MY_SIZE_T count[257];
+    for (;;) {
+        for (;;) {
+            if (n <= STRING_INSERTION_CUTOFF) {
+                for (i = 1; i < n; ++i) {
+                    MY_SIZE_T it = indx[i];
+                    for (j = i; j > 0 && strcmp(s[it] + d, s[indx[j - 1]] + d) < 0; --j)
+                        indx[j] = indx[j - 1];
+                    indx[j] = it;
+                }
+                return;
+            }
+            memset(count, 0, sizeof(count));
+            for (i = 0; i < n; ++i)
+                ++count[(unsigned char) s[indx[i]][d] + 1];
+            /* shortcut a common prefix rather than recursing through it */
+            int c = (unsigned char) s[indx[0]][d];
+            if (count[c + 1] == n) {
+                if (c == 0)
+                    return;  /* all strings end here, so all are equal */
+                ++d;
+                continue;
+            }
+            break;
+        }
+        for (int c = 0; c < 256; ++c)
+            count[c + 1] += count[c];
+        for (i = 0; i < n; ++i)
+            aux[count[(unsigned char) s[indx[i]][d]]++] = indx[i];
+        memcpy(indx, aux, n * sizeof(MY_SIZE_T));
+        /* count[c] is now the end of bucket c; bucket 0 holds strings that
+         * end here, which are equal and need no more sorting */
+        int big = 1;
+        for (int c = 2; c < 256; ++c)
+            if (count[c] - count[c - 1] > count[big] - count[big - 1])
+                big = c;
+        for (int c = 1; c < 256; ++c) {
+            MY_SIZE_T lo = count[c - 1], hi = count[c];
+            if (c != big && hi - lo > 1)
+                fr_radixsort_string_(s, indx + lo, aux, hi - lo, d + 1);
+        }
+        if (count[big] - count[big - 1] <= 1)
+            return;
+        indx += count[big - 1];
+        n = count[big] - count[big - 1];
+        ++d;
+    }
+}
+
+#define FR_HASH_PTR(__P, __BITS) \
+    ((size_t)((((uint64_t)(uintptr_t)(__P)) * 0x9E3779B97F4A7C15ULL) >> (64 - (__BITS))))
+
+/* Rank the nn non-NA strings at indx[0..nn-1], returning the unPROTECTed
+ * rank vector of length n, with NAs not yet ranked */
+static SEXP fr_rank_string_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T n,
+                            const MY_SIZE_T nn, const fr_ties_t ties_method,
+                            fr_tie_stats * tstats) {
+
+    if (nn >= INT_MAX)
+        error("too many strings in 'x'");
+
+    int *g = (int *) R_alloc(n, sizeof(int));  /* codes of non-NA values */
+
+    /* unique CHARSXPs by pointer, the table holds 1 + their position in u[] */
+    int bits = 1;
+    while (((size_t) 1 << bits) < 2 * (size_t) nn) ++bits;
+    size_t tsize = (size_t) 1 << bits;
+    int *table = (int *) R_alloc(tsize, sizeof(int));
+    memset(table, 0, tsize * sizeof(int));
+    SEXP *u = (SEXP *) R_alloc(nn, sizeof(SEXP));
+    int nu = 0;
+    for (MY_SIZE_T j = 0; j < nn; ++j) {
+        SEXP c = STRING_ELT(s_x, indx[j]);
+        size_t h = FR_HASH_PTR(c, bits);
+        while (table[h] && u[table[h] - 1] != c)
+            h = (h + 1) & (tsize - 1);
+        if (! table[h]) {
+            u[nu++] = c;
+            table[h] = nu;
+        }
+        g[indx[j]] = table[h] - 1;
+    }
+
+    /* sort the unique strings */
+    const char **us = (const char **) R_alloc(nu, sizeof(const char *));
+    MY_SIZE_T *uindx = (MY_SIZE_T *) R_alloc(nu, sizeof(MY_SIZE_T));
+    MY_SIZE_T *aux = (MY_SIZE_T *) R_alloc(nu, sizeof(MY_SIZE_T));
+    for (int k = 0; k < nu; ++k) {
+        us[k] = translateCharUTF8(u[k]);
+        uindx[k] = k;
+    }
+    fr_radixsort_string_(us, uindx, aux, nu, 0);
+
+    /* codes in rank order; different CHARSXPs with the same bytes, which
+     * differ only in their declared encoding, share a code */
+    int *code = (int *) R_alloc(nu, sizeof(int));
+    int ng = 0;
+    for (int k = 0; k < nu; ++k) {
+        if (k > 0 && strcmp(us[uindx[k]], us[uindx[k - 1]]) != 0)
+            ++ng;
+        code[uindx[k]] = ng;
+    }
+    if (nu > 0)
+        ++ng;
+    for (MY_SIZE_T j = 0; j < nn; ++j)
+        g[indx[j]] = code[g[indx[j]]];
+    for (MY_SIZE_T j = nn; j < n; ++j)
+        g[indx[j]] = -1;
+
+    return fr_rank_codes_(g, indx, n, nn, ng, ties_method, tstats);
+}
+
+
+
+/* DISTINCT VALUES ******************************************
+ *
+ * Integer and numeric vectors with few distinct values for their length,
+ * such as samples drawn with replacement from a small pool, are ranked as
+ * strings are.  The values are reduced to codes for their distinct values
+ * with a hash table, only the distinct values are sorted, and each value
+ * is ranked on the counting path using the rank of its distinct value as
+ * its code.  A sort of nn entries becomes one pass over them and a sort of
+ * the k distinct values.  Whether there are few enough is not known until
+ * they have been counted, so hashing gives up once there are more than
+ * nn / FR_DISTINCT_RATIO of them, and the caller sorts as usual.  Doubles
+ * are hashed by their bits, with -0 made 0 since the two are equal.
+ */
+
+#define FR_DISTINCT_MIN    4096
+#define FR_DISTINCT_RATIO  16
+
+#define FR_HASH_U64(__U, __BITS) \
+    ((size_t)(((uint64_t)(__U) * 0x9E3779B97F4A7C15ULL) >> (64 - (__BITS))))
+
+static inline uint64_t fr_bits_int_(const int v) {
+    return (uint64_t)(uint32_t) v;
+}
+
+static inline uint64_t fr_bits_double_(double v) {
+    uint64_t u;
+    if (v == 0.0)
+        v = 0.0;
+    memcpy(&u, &v, sizeof(u));
+    return u;
+}
+
+/* g[indx[j]] <- position in u[] of the distinct value of x[indx[j]], then
+ * sort u[] into uindx[], or give up when there are more than cap */
+#define FR_distinct_codes(__TYPE, __TCONV, __BITS, __SORT) \
+    { \
+    const __TYPE* x = __TCONV(s_x); \
+    __TYPE *u = (__TYPE *) R_alloc(cap, sizeof(__TYPE)); \
+    for (MY_SIZE_T j = 0; j < nn; ++j) { \
+        __TYPE v = x[indx[j]]; \
+        size_t h = FR_HASH_U64(__BITS(v), bits); \
+        while (table[h] && ! (u[table[h] - 1] == v)) \
+            h = (h + 1) & (tsize - 1); \
+        if (! table[h]) { \
+            if (nu == cap) { \
+                vmaxset(vmax); \
+                return NULL; \
+            } \
+            u[nu++] = v; \
+            table[h] = nu; \
+        } \
+        g[indx[j]] = table[h] - 1; \
+    } \
+    uindx = (MY_SIZE_T *) R_alloc(nu, sizeof(MY_SIZE_T)); \
+    for (int k = 0; k < nu; ++k) \
+        uindx[k] = k; \
+    __SORT(u, uindx, nu, sort_method); \
+    }
+
+/* Rank the nn non-NA values at indx[0..nn-1] from their distinct values,
+ * returning the unPROTECTed rank vector of length n, with NAs not yet
+ * ranked, or NULL if x is not a logical, integer or numeric vector or has
+ * too many distinct values */
+static SEXP fr_rank_distinct_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T n,
+                              const MY_SIZE_T nn, const fr_ties_t ties_method,
+                              fr_tie_stats * tstats, const int sort_method) {
+
+    int type = fr_typeof_(s_x);
+    if ((type != REALSXP && type != INTSXP && type != LGLSXP)
+        || nn < FR_DISTINCT_MIN)
+        return NULL;
+    MY_SIZE_T ncap = nn / FR_DISTINCT_RATIO;
+    int cap = (ncap < INT_MAX / 2) ? (int) ncap : INT_MAX / 2;
+
+    const void *vmax = vmaxget();
+    int *g = (int *) R_alloc(n, sizeof(int));  /* codes of non-NA values */
+
+    /* the table holds 1 + positions in u[], and is at most half full */
+    int bits = 1;
+    while (((size_t) 1 << bits) < 2 * (size_t) cap) ++bits;
+    size_t tsize = (size_t) 1 << bits;
+    int *table = (int *) R_alloc(tsize, sizeof(int));
+    memset(table, 0, tsize * sizeof(int));
+    int nu = 0;
+    MY_SIZE_T *uindx = NULL;
+
+    if (type == REALSXP)
+        FR_distinct_codes(double, REAL, fr_bits_double_, fr_sort_double_)
+    else
+        FR_distinct_codes(int, INTEGER, fr_bits_int_, fr_sort_integer_)
+
+    /* codes in rank order */
+    int *code = (int *) R_alloc(nu, sizeof(int));
+    for (int k = 0; k < nu; ++k)
+        code[uindx[k]] = k;
+    for (MY_SIZE_T j = 0; j < nn; ++j)
+        g[indx[j]] = code[g[indx[j]]];
+    for (MY_SIZE_T j = nn; j < n; ++j)
+        g[indx[j]] = -1;
+
+    return fr_rank_codes_(g, indx, n, nn, nu, ties_method, tstats);
+}
+
+
+
+/* FACTORS ******************************************
+ *
+ * Factors are ranked by their integer codes, as base rank does, on the
+ * counting path.  fastrank_factor_ can also rank by a permutation of the
+ * levels.
+ */
+
+static int fr_nlevels_(SEXP s_x) {
+    MY_SIZE_T nlev = MY_LENGTH(getAttrib(s_x, R_LevelsSymbol));
+    if (nlev >= INT_MAX)
+        error("too many levels in 'x'");
+    return (int) nlev;
+}
+
+
+
+/* Prepare to collect tie statistics for nn values, returning ts */
+static fr_tie_stats * fr_init_tie_stats_(fr_tie_stats * ts,
+                                         const MY_SIZE_T nn) {
+    ts->ngroups = 0;
+    ts->sizes = (MY_SIZE_T *) R_alloc(nn / 2 + 1, sizeof(MY_SIZE_T));
+    ts->sum3 = 0.0;
+    return ts;
+}
+
+/* Attach tie statistics, if collected, to s_ranks as attributes
+ * "ties.ngroups", "ties.sizes" and "ties.sum3".  Counts are integer unless x
+ * is a long vector */
+static void fr_set_tie_stats_(SEXP s_ranks, const fr_tie_stats * ts,
+                              const MY_SIZE_T n) {
+    if (! ts)
+        return;
+    SEXP s_ngroups, s_sizes;
+    if (n <= INT_MAX) {
+        s_ngroups = PROTECT(ScalarInteger((int) ts->ngroups));
+        s_sizes = PROTECT(allocVector(INTSXP, ts->ngroups));
+        for (MY_SIZE_T k = 0; k < ts->ngroups; ++k)
+            INTEGER(s_sizes)[k] = (int) ts->sizes[k];
+    } else {
+        s_ngroups = PROTECT(ScalarReal((double) ts->ngroups));
+        s_sizes = PROTECT(allocVector(REALSXP, ts->ngroups));
+        for (MY_SIZE_T k = 0; k < ts->ngroups; ++k)
+            REAL(s_sizes)[k] = (double) ts->sizes[k];
+    }
+    setAttrib(s_ranks, install("ties.ngroups"), s_ngroups);
+    setAttrib(s_ranks, install("ties.sizes"), s_sizes);
+    setAttrib(s_ranks, install("ties.sum3"), ScalarReal(ts->sum3));
+    UNPROTECT(2);
+}
+
+
+
+/* The rank vector of R type type and length n: s_out if it is not
+ * R_NilValue, once checked that it fits, otherwise a new vector */
+static SEXP fr_alloc_ranks_(SEXP s_out, const SEXPTYPE type,
+                            const MY_SIZE_T n) {
+    if (s_out == R_NilValue)
+        return allocVector(type, n);
+    if (TYPEOF(s_out) != type || MY_LENGTH(s_out) != n)
+        error("'out' must be %s vector the same length as 'x' for this ties.method",
+              type == REALSXP ? "a double" : "an integer");
+    return s_out;
+}
+
+/* Rank the nn non-NA values of s_x from indx[], which is sorted so that
+ * indx[0] holds the position in s_x of the lowest value.  Returns the
+ * unPROTECTed rank vector of length n, with NAs not yet ranked, which is
+ * s_out unless that is R_NilValue.  Character vectors are only ranked here
+ * by fastorder_, as fastrank_ ranks them on the counting path */
+#undef FR_ALLOC_RANKS
+#define FR_ALLOC_RANKS(__R_RTYPE) fr_alloc_ranks_(s_out, __R_RTYPE, n)
+static SEXP fr_rank_index_(SEXP s_x, const MY_SIZE_T indx[],
+                           const MY_SIZE_T n, const MY_SIZE_T nn,
+                           const fr_ties_t ties_method,
+                           fr_tie_stats * tstats, SEXP s_out) {
+
+    SEXP s_ranks = NULL;  /* return value, allocated and PROTECTed within FR_rank */
+
+    switch (fr_typeof_(s_x)) {
+    case LGLSXP:
+    case INTSXP:
+        {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE int
+#define TCONV INTEGER
+            switch(ties_method) {
+            case TIES_AVERAGE:
+                FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
+                break;
+            case TIES_FIRST:
+                FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+                break;
+            case TIES_RANDOM: {
+                FR_RNG_SEED
+                FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            }
+            case TIES_MAX:
+                FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_MIN:
+                FR_rank(FR_ties_min, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            default:
+                error("unknown 'ties.method', should never be reached");
+                break;
+            }
+#undef EQUAL
+#undef TYPE
 #undef TCONV
         }
         break;
@@ -681,11 +1235,107 @@ SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort) {
             case TIES_FIRST:
                 FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
                 break;
-            case TIES_RANDOM:
-                GetRNGstate();
+            case TIES_RANDOM: {
+                FR_RNG_SEED
+                FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            }
+            case TIES_MAX:
+                FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_MIN:
+                FR_rank(FR_ties_min, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            default:
+                error("unknown 'ties.method', should never be reached");
+                break;
+            }
+#undef EQUAL
+#undef TYPE
+#undef TCONV
+        }
+        break;
+    case CPLXSXP:
+        {
+#define EQUAL(_x, _y) __CPLX_EQUAL(_x, _y)
+#define TYPE Rcomplex
+#define TCONV COMPLEX
+            switch(ties_method) {
+            case TIES_AVERAGE:
+                FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
+                break;
+            case TIES_FIRST:
+                FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_RANDOM: {
+                FR_RNG_SEED
+                FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            }
+            case TIES_MAX:
+                FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_MIN:
+                FR_rank(FR_ties_min, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            default:
+                error("unknown 'ties.method', should never be reached");
+                break;
+            }
+#undef EQUAL
+#undef TYPE
+#undef TCONV
+        }
+        break;
+    case INT64SXP:
+        {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE int64_t
+#define TCONV FR_INT64
+            switch(ties_method) {
+            case TIES_AVERAGE:
+                FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
+                break;
+            case TIES_FIRST:
+                FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_RANDOM: {
+                FR_RNG_SEED
+                FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            }
+            case TIES_MAX:
+                FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_MIN:
+                FR_rank(FR_ties_min, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            default:
+                error("unknown 'ties.method', should never be reached");
+                break;
+            }
+#undef EQUAL
+#undef TYPE
+#undef TCONV
+        }
+        break;
+    case STRSXP:
+        {
+#define EQUAL(_x, _y) (_x == _y || Seql(_x, _y))
+#define TYPE SEXP
+#define TCONV FR_STRING_PTR
+            switch(ties_method) {
+            case TIES_AVERAGE:
+                FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
+                break;
+            case TIES_FIRST:
+                FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
+                break;
+            case TIES_RANDOM: {
+                FR_RNG_SEED
                 FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
-                PutRNGstate();
                 break;
+            }
             case TIES_MAX:
                 FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
                 break;
@@ -701,46 +1351,1388 @@ SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort) {
 #undef TCONV
         }
         break;
-#if 0
-    case CPLXSXP:
-        {
-#define EQUAL(_x, _y) (_x.r == _y.r && _x.i == _y.i)
-#define TYPE Rcomplex
-#define TCONV COMPLEX
-            switch(ties_method) {
-            case TIES_AVERAGE:
-                FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
-                break;
-            case TIES_FIRST:
-                FR_rank(FR_ties_first, TYPE, TCONV, int, INTSXP, INTEGER)
-                break;
-            case TIES_RANDOM:
-                GetRNGstate();
-                FR_rank(FR_ties_random, TYPE, TCONV, int, INTSXP, INTEGER)
-                PutRNGstate();
-                break;
-            case TIES_MAX:
-                FR_rank(FR_ties_max, TYPE, TCONV, int, INTSXP, INTEGER)
-                break;
-            case TIES_MIN:
-                FR_rank(FR_ties_min, TYPE, TCONV, int, INTSXP, INTEGER)
-                break;
-            default:
-                error("unknown 'ties.method', should never be reached");
-                break;
-            }
+    default:
+        error("'x' is not a logical, integer, numeric, complex or character vector");
+        break;
+    }
+
+    UNPROTECT(1);
+    return s_ranks;
+}
+#undef FR_ALLOC_RANKS
+#define FR_ALLOC_RANKS(__R_RTYPE) allocVector(__R_RTYPE, n)
+
+
+
+/* General ranking, called from fastrank() wrapper */
+SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort, SEXP s_na,
+               SEXP s_stats) {
+
+    if (TYPEOF(s_x) != REALSXP && TYPEOF(s_x) != INTSXP && TYPEOF(s_x) != LGLSXP
+        && TYPEOF(s_x) != CPLXSXP && TYPEOF(s_x) != STRSXP)
+        error("type of 'x' not supported");
+
+    int sort_method = fr_sort_method_(s_sort);
+
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    if (DEBUG) Rprintf("length of s_x = %d\n", n);
+
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    fr_na_t na_last = fr_na_last_(s_na);
+
+    FR_PHASE_START;
+
+    /* allocate index and fill with 0..n-1, with NAs moved to the end.  Only
+     * the nn non-NA entries are sorted and ranked */
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+    FR_PHASE(FR_PHASE_INIT);
+
+    fr_tie_stats ts, *tstats = NULL;
+    if (asLogical(s_stats) == TRUE)
+        tstats = fr_init_tie_stats_(&ts, nn);
+
+    SEXP s_ranks = NULL;  /* return value, allocated below */
+
+    /* character vectors, factors, and vectors with few distinct values take
+     * the counting path; factor codes are 1..nlevels and NA is negative, so
+     * code 0 is simply unused */
+    if (TYPEOF(s_x) == STRSXP)
+        s_ranks = fr_rank_string_(s_x, indx, n, nn, ties_method, tstats);
+    else if (isFactor(s_x))
+        s_ranks = fr_rank_codes_(INTEGER(s_x), indx, n, nn,
+                                 fr_nlevels_(s_x) + 1, ties_method, tstats);
+    else
+        s_ranks = fr_rank_distinct_(s_x, indx, n, nn, ties_method, tstats,
+                                    sort_method);
+    if (s_ranks) {
+        PROTECT(s_ranks);
+        s_ranks = PROTECT(fr_rank_na_(s_ranks, indx, n, nn, na_last));
+        FR_PHASE(FR_PHASE_RANK);
+        fr_set_tie_stats_(s_ranks, tstats, n);
+        UNPROTECT(2);
+        return s_ranks;
+    }
+
+    if (DEBUG) {
+        Rprintf("sort return indx:\n");
+        for (int i = 0; i < n; ++i) Rprintf("%d ", indx[i]);
+        Rprintf("\n");
+    }
+
+    /* sort indices!!  probably should move this to within the big switch */
+    fr_sort_index_(s_x, indx, nn, sort_method);
+    if (ties_method == TIES_FIRST)
+        fr_stable_index_(s_x, indx, nn);
+    FR_PHASE(FR_PHASE_SORT);
+
+    /* indx[i] holds the index of the value in s_x that belongs in position i,
+     * e.g., indx[0] holds the position in s_x of the lowest value */
+
+    if (DEBUG) {
+        Rprintf("sort return indx:\n");
+        for (int i = 0; i < n; ++i) Rprintf("%d ", indx[i]);
+        Rprintf("\n");
+    }
+
+    /* now decide which way to go and do it! */
+
+    s_ranks = PROTECT(fr_rank_index_(s_x, indx, n, nn, ties_method, tstats,
+                                     R_NilValue));
+    s_ranks = PROTECT(fr_rank_na_(s_ranks, indx, n, nn, na_last));
+    FR_PHASE(FR_PHASE_RANK);
+    fr_set_tie_stats_(s_ranks, tstats, n);
+
+    UNPROTECT(2);
+    return s_ranks;
+}
+
+
+
+/* Rank into the vector s_out rather than a new one, called from
+ * fastrank_into() wrapper, so the only allocation is the sort index, which
+ * is R_alloc scratch.  s_out is the same length as s_x, double for "average"
+ * and integer otherwise, and is returned; if it may be shared with another
+ * variable, which would see the ranks too, they are written into a copy.
+ * na.last = NA is not available since it would shorten the ranks */
+
+SEXP fastrank_into_(SEXP s_x, SEXP s_out, SEXP s_tm, SEXP s_sort,
+                    SEXP s_na) {
+
+    int type = fr_typeof_(s_x);
+    if ((type != REALSXP && type != INTSXP && type != LGLSXP
+         && type != CPLXSXP && type != INT64SXP) || isFactor(s_x))
+        error("type of 'x' not supported");
+    int sort_method = asInteger(s_sort);
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    fr_na_t na_last = fr_na_last_(s_na);
+    if (na_last == NA_LAST_NA)
+        error("'na.last' cannot be NA when ranking into 'out'");
+    if (MAYBE_SHARED(s_out))
+        s_out = duplicate(s_out);
+    PROTECT(s_out);
+
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+    fr_sort_index_(s_x, indx, nn, sort_method);
+    if (ties_method == TIES_FIRST)
+        fr_stable_index_(s_x, indx, nn);
+    fr_rank_index_(s_x, indx, n, nn, ties_method, NULL, s_out);
+    fr_rank_na_(s_out, indx, n, nn, na_last);
+    UNPROTECT(1);
+    return s_out;
+}
+
+/* Counters and phase times for the last call to fastrank_, all NA unless
+ * built with -DFR_INSTRUMENT=1 */
+SEXP fastrank_stats_(void) {
+    static const char * names[] = { "instrumented", "comparisons", "swaps",
+        "insertion.sorts", "max.depth", "time.init", "time.sort", "time.rank" };
+    const int nnames = (int) (sizeof(names) / sizeof(names[0]));
+    double v[] = {
+#if FR_INSTRUMENT
+        fr_sort_counters.comparisons, fr_sort_counters.swaps,
+        fr_sort_counters.insertion_sorts, fr_sort_counters.max_depth,
+        fr_phase_time[FR_PHASE_INIT], fr_phase_time[FR_PHASE_SORT],
+        fr_phase_time[FR_PHASE_RANK]
+#else
+        NA_REAL, NA_REAL, NA_REAL, NA_REAL, NA_REAL, NA_REAL, NA_REAL
+#endif
+    };
+    SEXP s_stats = PROTECT(allocVector(VECSXP, nnames));
+    SEXP s_names = PROTECT(allocVector(STRSXP, nnames));
+    for (int i = 0; i < nnames; ++i)
+        SET_STRING_ELT(s_names, i, mkChar(names[i]));
+    SET_VECTOR_ELT(s_stats, 0, ScalarLogical(FR_INSTRUMENT ? TRUE : FALSE));
+    for (int i = 1; i < nnames; ++i)
+        SET_VECTOR_ELT(s_stats, i, ScalarReal(v[i - 1]));
+    setAttrib(s_stats, R_NamesSymbol, s_names);
+    UNPROTECT(2);
+    return s_stats;
+}
+
+
+
+/* Rank a factor by its codes, or by the levels in the order given by the
+ * permutation s_levels of 1..nlevels, called from fastrank_factor() */
+SEXP fastrank_factor_(SEXP s_x, SEXP s_tm, SEXP s_levels, SEXP s_na) {
+
+    if (! isFactor(s_x))
+        error("'x' is not a factor");
+
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    int nlev = fr_nlevels_(s_x);
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    fr_na_t na_last = fr_na_last_(s_na);
+
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+
+    const int *g = INTEGER(s_x);
+    if (! isNull(s_levels)) {
+        /* map codes through the inverse permutation, NA stays negative */
+        if (TYPEOF(s_levels) != INTSXP || LENGTH(s_levels) != nlev)
+            error("'levels.order' must be a permutation of 1..nlevels(x)");
+        const int *lo = INTEGER(s_levels);
+        int *map = (int *) R_alloc(nlev + 1, sizeof(int));
+        memset(map, 0, (nlev + 1) * sizeof(int));
+        for (int k = 0; k < nlev; ++k) {
+            if (lo[k] < 1 || lo[k] > nlev || map[lo[k]])
+                error("'levels.order' must be a permutation of 1..nlevels(x)");
+            map[lo[k]] = k + 1;
+        }
+        int *gg = (int *) R_alloc(n, sizeof(int));
+        for (MY_SIZE_T i = 0; i < n; ++i)
+            gg[i] = (g[i] >= 1 && g[i] <= nlev) ? map[g[i]] : g[i];
+        g = gg;
+    }
+
+    SEXP s_ranks = PROTECT(fr_rank_codes_(g, indx, n, nn, nlev + 1,
+                                          ties_method, NULL));
+    s_ranks = fr_rank_na_(s_ranks, indx, n, nn, na_last);
+
+    UNPROTECT(1);
+    return s_ranks;
+}
+
+
+
+/* ORDER ******************************************
+ *
+ * fastorder_ returns the sort index itself, 1-based, as a replacement for
+ * order(), and optionally the ranks from the same sort.  order() is stable,
+ * so after an unstable sort the positions within each run of ties are put
+ * back in increasing order.  The counting path and the integer64 radix sort
+ * are already stable.
+ */
+
+/* Sort the positions within each run of ties in the sorted indx[0..nn-1],
+ * also used by fastrank_ and fastrank_into_ for ties.method "first" */
+static void fr_stable_index_(SEXP s_x, MY_SIZE_T indx[], const MY_SIZE_T nn) {
+    switch (fr_typeof_(s_x)) {
+    case LGLSXP:
+    case INTSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_stable_runs(int, INTEGER)
+#undef EQUAL
+        break;
+    case REALSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_stable_runs(double, REAL)
+#undef EQUAL
+        break;
+    case CPLXSXP:
+#define EQUAL(_x, _y) __CPLX_EQUAL(_x, _y)
+        FR_stable_runs(Rcomplex, COMPLEX)
+#undef EQUAL
+        break;
+    default:  /* INT64SXP is radix sorted */
+        break;
+    }
+}
+
+
+
+/* Order and optionally rank a vector from a single sort, called from
+ * fastorder() wrapper.  If s_tm is NULL, the order is returned, otherwise a
+ * list of the order and the ranks */
+SEXP fastorder_(SEXP s_x, SEXP s_tm, SEXP s_sort, SEXP s_na) {
+
+    if (TYPEOF(s_x) != REALSXP && TYPEOF(s_x) != INTSXP && TYPEOF(s_x) != LGLSXP
+        && TYPEOF(s_x) != CPLXSXP && TYPEOF(s_x) != STRSXP)
+        error("type of 'x' not supported");
+
+    int sort_method = fr_sort_method_(s_sort);
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    int want_ranks = ! isNull(s_tm);
+    fr_ties_t ties_method = want_ranks ? fr_ties_method_(s_tm) : TIES_FIRST;
+    fr_na_t na_last = fr_na_last_(s_na);
+    if (na_last == NA_LAST_KEEP)
+        error("'na.last' must be TRUE, FALSE or NA for ordering");
+
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+
+    SEXP s_ranks = NULL;
+
+    if (TYPEOF(s_x) == STRSXP || isFactor(s_x)) {
+        /* the counting path sorts indx[] stably for "first", and those ranks
+         * are kept if they were asked for */
+        if (TYPEOF(s_x) == STRSXP)
+            s_ranks = fr_rank_string_(s_x, indx, n, nn, TIES_FIRST, NULL);
+        else
+            s_ranks = fr_rank_codes_(INTEGER(s_x), indx, n, nn,
+                                     fr_nlevels_(s_x) + 1, TIES_FIRST, NULL);
+        if (ties_method != TIES_FIRST)
+            s_ranks = NULL;
+    } else {
+        fr_sort_index_(s_x, indx, nn, sort_method);
+        fr_stable_index_(s_x, indx, nn);
+    }
+
+    if (! want_ranks) {
+        s_ranks = R_NilValue;
+    } else {
+        if (s_ranks == NULL)
+            s_ranks = fr_rank_index_(s_x, indx, n, nn, ties_method, NULL,
+                                     R_NilValue);
+        PROTECT(s_ranks);
+        s_ranks = fr_rank_na_(s_ranks, indx, n, nn, na_last);
+        UNPROTECT(1);
+    }
+    PROTECT(s_ranks);
+
+    /* NAs are at the end of indx[] in their original order */
+    MY_SIZE_T no = (na_last == NA_LAST_NA) ? nn : n;
+    MY_SIZE_T start = (na_last == NA_LAST_FALSE) ? nn : 0;
+    SEXP s_order;
+    if (n <= INT_MAX) {
+        s_order = PROTECT(allocVector(INTSXP, no));
+        int *order = INTEGER(s_order);
+        for (MY_SIZE_T i = 0; i < no; ++i)
+            order[i] = (int)(indx[start + i < n ? start + i : start + i - n] + 1);
+    } else {
+        s_order = PROTECT(allocVector(REALSXP, no));
+        double *order = REAL(s_order);
+        for (MY_SIZE_T i = 0; i < no; ++i)
+            order[i] = (double)(indx[start + i < n ? start + i : start + i - n] + 1);
+    }
+
+    if (! want_ranks) {
+        UNPROTECT(2);
+        return s_order;
+    }
+
+    SEXP s_ans = PROTECT(allocVector(VECSXP, 2));
+    SEXP s_names = PROTECT(allocVector(STRSXP, 2));
+    SET_VECTOR_ELT(s_ans, 0, s_order);
+    SET_VECTOR_ELT(s_ans, 1, s_ranks);
+    SET_STRING_ELT(s_names, 0, mkChar("order"));
+    SET_STRING_ELT(s_names, 1, mkChar("rank"));
+    setAttrib(s_ans, R_NamesSymbol, s_names);
+
+    UNPROTECT(4);
+    return s_ans;
+}
+
+
+
+/* SCORES ******************************************
+ *
+ * Ranks transformed to percentiles, normal scores or ntiles as they are
+ * stored, by running the rank walk with ranks written to FR_TO_SCORES
+ * rather than transforming them in a second pass.  The score of the last
+ * rank stored is kept, so within a run of tied ranks it is computed once,
+ * which matters for the normal scores.  m is the number of values ranked,
+ * NAs excluded, and NAs are scored NA.
+ */
+
+typedef enum { SCORE_ERROR = 0, SCORE_PERCENT, SCORE_MIDPOINT, SCORE_BLOM,
+               SCORE_VDW, SCORE_NTILE } fr_score_t;
+
+static fr_score_t fr_score_type_(SEXP s_type) {
+    if (TYPEOF(s_type) != STRSXP || LENGTH(s_type) < 1)
+        error("'type' must be \"percent\", \"midpoint\", \"blom\", \"vdw\" or \"ntile\"");
+    const char *t = CHAR(STRING_ELT(s_type, 0));
+    if (! strcmp(t, "percent"))  return SCORE_PERCENT;
+    if (! strcmp(t, "midpoint")) return SCORE_MIDPOINT;
+    if (! strcmp(t, "blom"))     return SCORE_BLOM;
+    if (! strcmp(t, "vdw"))      return SCORE_VDW;
+    if (! strcmp(t, "ntile"))    return SCORE_NTILE;
+    error("'type' must be \"percent\", \"midpoint\", \"blom\", \"vdw\" or \"ntile\"");
+    return SCORE_ERROR;  /* not reached */
+}
+
+/* Score of rank r among m values, into k groups for ntiles */
+static double fr_score_(const fr_score_t score, const double r,
+                        const double m, const int k) {
+    switch (score) {
+    case SCORE_PERCENT:
+        return m > 1 ? (r - 1) / (m - 1) : 0.0;
+    case SCORE_MIDPOINT:
+        return (r - 0.5) / m;
+    case SCORE_BLOM:
+        return qnorm((r - 0.375) / (m + 0.25), 0.0, 1.0, 1, 0);
+    case SCORE_VDW:
+        return qnorm(r / (m + 1), 0.0, 1.0, 1, 0);
+    case SCORE_NTILE:
+        return floor(k * (r - 1) / m) + 1;
+    default:
+        return NA_REAL;
+    }
+}
+
+#define FR_TO_SCORES_AT(_j_) ranks[indx[_j_]]
+#define FR_TO_SCORES_STORE(_j_, _r_) \
+    FR_TO_SCORES_AT(_j_) = ((double)(_r_) == last_r ? last_s : \
+        (last_r = (double)(_r_), last_s = fr_score_(score, last_r, m, k)))
+
+#define FR_scores(__TYPE, __TCONV) \
+    switch (ties_method) { \
+    case TIES_AVERAGE: \
+        FR_rank_walk_to(FR_TO_SCORES, FR_ties_average, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_FIRST: \
+        FR_rank_walk_to(FR_TO_SCORES, FR_ties_first, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_RANDOM: { \
+        FR_RNG_SEED \
+        FR_rank_walk_to(FR_TO_SCORES, FR_ties_random, __TYPE, __TCONV, double, nn) \
+        break; \
+    } \
+    case TIES_MAX: \
+        FR_rank_walk_to(FR_TO_SCORES, FR_ties_max, __TYPE, __TCONV, double, nn) \
+        break; \
+    case TIES_MIN: \
+        FR_rank_walk_to(FR_TO_SCORES, FR_ties_min, __TYPE, __TCONV, double, nn) \
+        break; \
+    default: \
+        error("unknown 'ties.method', should never be reached"); \
+        break; \
+    }
+
+/* Scores of the ranks of s_x, called from fastrank_scores() wrapper */
+SEXP fastrank_scores_(SEXP s_x, SEXP s_type, SEXP s_k, SEXP s_tm,
+                      SEXP s_sort) {
+
+    int type = fr_typeof_(s_x);
+    if ((type != REALSXP && type != INTSXP && type != LGLSXP
+         && type != CPLXSXP && type != INT64SXP) || isFactor(s_x))
+        error("type of 'x' not supported");
+    const fr_score_t score = fr_score_type_(s_type);
+    const int k = asInteger(s_k);
+    if (score == SCORE_NTILE && (k == NA_INTEGER || k < 1))
+        error("'ntiles' must be a positive integer");
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    int sort_method = asInteger(s_sort);
+
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+    fr_sort_index_(s_x, indx, nn, sort_method);
+    if (ties_method == TIES_FIRST)
+        fr_stable_index_(s_x, indx, nn);
+
+    SEXP s_scores = PROTECT(allocVector(REALSXP, n));
+    double *ranks = REAL(s_scores);
+    const double m = (double) nn;
+    double last_r = -1.0, last_s = 0.0;
+    fr_tie_stats *tstats = NULL;
+
+    switch (type) {
+    case LGLSXP:
+    case INTSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_scores(int, INTEGER)
+#undef EQUAL
+        break;
+    case REALSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_scores(double, REAL)
+#undef EQUAL
+        break;
+    case CPLXSXP:
+#define EQUAL(_x, _y) __CPLX_EQUAL(_x, _y)
+        FR_scores(Rcomplex, COMPLEX)
+#undef EQUAL
+        break;
+    case INT64SXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_scores(int64_t, FR_INT64)
+#undef EQUAL
+        break;
+    }
+    for (MY_SIZE_T j = nn; j < n; ++j)
+        ranks[indx[j]] = NA_REAL;
+
+    UNPROTECT(1);
+    return s_scores;
+}
+
+
+
+/* RANK SUMS ******************************************
+ *
+ * Rank-sum tests need only the sum of the ranks within each group, so rather
+ * than allocating and filling a rank vector, the rank walk is run with ranks
+ * written to FR_TO_SUMS, which adds each to the sum for the group of its
+ * value.  Ties
+ * always take their average rank, and the tie correction comes from the
+ * tie statistics collected during the same walk.
+ */
+
+/* Sum the average ranks of the values of s_x within the groups s_g, codes
+ * 1..k, into sums[1..k] and count them into cnt[1..k], omitting values
+ * where either s_x or s_g is NA.  Returns the number of values ranked */
+static MY_SIZE_T fr_rank_sums_(SEXP s_x, SEXP s_g, const int k,
+                               const int sort_method, double sums[],
+                               MY_SIZE_T cnt[], fr_tie_stats * tstats) {
+
+    int type = fr_typeof_(s_x);
+    if (type != REALSXP && type != INTSXP && type != LGLSXP && type != INT64SXP)
+        error("'x' is not a logical, integer or numeric vector");
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    if (TYPEOF(s_g) != INTSXP || MY_LENGTH(s_g) != n)
+        error("'g' must be an integer vector the same length as 'x'");
+    const int *g = INTEGER(s_g);
+
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+    MY_SIZE_T m = 0;
+    memset(sums, 0, (k + 1) * sizeof(double));
+    memset(cnt, 0, (k + 1) * sizeof(MY_SIZE_T));
+    for (MY_SIZE_T j = 0; j < nn; ++j) {
+        int c = g[indx[j]];
+        if (c == NA_INTEGER)
+            continue;
+        if (c < 1 || c > k)
+            error("group code %d of 'g' out of range", c);
+        ++cnt[c];
+        indx[m++] = indx[j];
+    }
+
+    fr_sort_index_(s_x, indx, m, sort_method);
+
+#define FR_TO_SUMS_STORE(_j_, _r_) sums[g[indx[_j_]]] += (_r_)
+    switch (type) {
+    case LGLSXP:
+    case INTSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_rank_walk_to(FR_TO_SUMS, FR_ties_average, int, INTEGER, double, m)
+#undef EQUAL
+        break;
+    case REALSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_rank_walk_to(FR_TO_SUMS, FR_ties_average, double, REAL, double, m)
+#undef EQUAL
+        break;
+    case INT64SXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_rank_walk_to(FR_TO_SUMS, FR_ties_average, int64_t, FR_INT64, double, m)
+#undef EQUAL
+        break;
+    }
+#undef FR_TO_SUMS_STORE
+
+    return m;
+}
+
+
+
+/* Wilcoxon rank-sum statistic W of group 1 against group 2, as returned by
+ * wilcox.test(), called from fastrank_wilcox() wrapper */
+SEXP fastrank_wilcox_(SEXP s_x, SEXP s_g, SEXP s_sort) {
+    double sums[3];
+    MY_SIZE_T cnt[3];
+    fr_tie_stats ts = { 0, NULL, 0.0 };
+    fr_rank_sums_(s_x, s_g, 2, fr_sort_method_(s_sort), sums, cnt, &ts);
+    if (cnt[1] == 0 || cnt[2] == 0)
+        error("not enough non-missing observations in each group");
+    double n1 = (double) cnt[1];
+    return ScalarReal(sums[1] - n1 * (n1 + 1) / 2.0);
+}
+
+
+
+/* Kruskal-Wallis rank-sum statistic H with tie correction over groups with
+ * codes 1..k, as returned by kruskal.test(), called from fastrank_kruskal()
+ * wrapper */
+SEXP fastrank_kruskal_(SEXP s_x, SEXP s_g, SEXP s_k, SEXP s_sort) {
+    int k = asInteger(s_k);
+    if (k == NA_INTEGER || k < 1)
+        error("'k' must be a positive number of groups");
+    double *sums = (double *) R_alloc(k + 1, sizeof(double));
+    MY_SIZE_T *cnt = (MY_SIZE_T *) R_alloc(k + 1, sizeof(MY_SIZE_T));
+    fr_tie_stats ts = { 0, NULL, 0.0 };
+    MY_SIZE_T m = fr_rank_sums_(s_x, s_g, k, fr_sort_method_(s_sort), sums,
+                                cnt, &ts);
+    double stat = 0.0;
+    int ng = 0;
+    for (int c = 1; c <= k; ++c) {
+        if (cnt[c] == 0)
+            continue;
+        stat += sums[c] * sums[c] / (double) cnt[c];
+        ++ng;
+    }
+    if (ng < 2)
+        error("all observations are in the same group");
+    double N = (double) m;
+    stat = (12.0 * stat / (N * (N + 1)) - 3.0 * (N + 1)) /
+           (1.0 - ts.sum3 / (N * N * N - N));
+    return ScalarReal(stat);
+}
+
+
+
+/* SPEARMAN CORRELATION ******************************************
+ *
+ * The columns of a matrix are ranked in parallel, ties given their average
+ * rank, by a column ranker that uses no R API.  Average ranks always have
+ * mean (n + 1) / 2, and their sum of squared deviations is
+ * (n^3 - n - sum(t^3 - t)) / 12 over the sizes t of the runs of ties, which
+ * the rank walk collects, so each column is centred and scaled to unit norm
+ * with no further pass.  The correlations are then the cross products of the
+ * columns, found in tiles of FR_SPEARMAN_BLOCK columns by FR_SPEARMAN_ROWS
+ * rows so both blocks of columns stay in cache.
+ */
+
+#define FR_SPEARMAN_BLOCK  32
+#define FR_SPEARMAN_ROWS   2048
+
+/* the column being ranked, standing in for TCONV(s_x) in FR_rank_walk */
+#define FR_COLUMN(_s) ((TYPE *) col)
+
+/* Rank col[0..n-1] into r[] with indx[] as scratch, returning the sum of
+ * t^3 - t over the runs of ties, or -1 if there are NAs.  Safe to call from
+ * several threads, as sort_method has been checked */
+#define FR_rank_column(__SORT, __ISNA) \
+    { \
+    for (MY_SIZE_T i = 0; i < n; ++i) { \
+        if (__ISNA(col[i])) return -1.0; \
+        indx[i] = i; \
+    } \
+    __SORT(col, indx, n, sort_method); \
+    fr_tie_stats ts = { 0, NULL, 0.0 }, *tstats = &ts; \
+    double *ranks = r; \
+    FR_rank_walk(FR_ties_average, TYPE, FR_COLUMN, double, n) \
+    return ts.sum3; \
+    }
+
+static double fr_rank_column_int_(const int * col, const MY_SIZE_T n,
+                                  const int sort_method, MY_SIZE_T indx[],
+                                  double r[]) {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE int
+    FR_rank_column(fr_sort_integer_, FR_ISNA_INT)
+#undef EQUAL
+#undef TYPE
+}
+
+static double fr_rank_column_double_(const double * col, const MY_SIZE_T n,
+                                     const int sort_method, MY_SIZE_T indx[],
+                                     double r[]) {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE double
+    FR_rank_column(fr_sort_double_, FR_ISNA_REAL)
+#undef EQUAL
+#undef TYPE
+}
+
+/* Spearman correlation matrix of the columns of s_x, as returned by
+ * cor(x, method = "spearman"), called from fastrank_spearman() wrapper */
+SEXP fastrank_spearman_(SEXP s_x, SEXP s_sort, SEXP s_threads) {
+
+    int type = TYPEOF(s_x);
+    if (! isMatrix(s_x) || (type != REALSXP && type != INTSXP && type != LGLSXP))
+        error("'x' must be a logical, integer or numeric matrix");
+    int sort_method = asInteger(s_sort);
+    if (sort_method < 1 || sort_method > 7
+        || (type == REALSXP && sort_method > 1 && sort_method < 5))
+        error("unknown 'sort.method' for 'x'");
+    int nthreads = asInteger(s_threads);
+    if (nthreads == NA_INTEGER || nthreads < 1)
+        nthreads = 1;
+#ifndef _OPENMP
+    nthreads = 1;
+#endif
+
+    MY_SIZE_T n = INTEGER(getAttrib(s_x, R_DimSymbol))[0];
+    int p = INTEGER(getAttrib(s_x, R_DimSymbol))[1];
+
+    /* centred and scaled ranks by column, scale[j] is NA if column j has NAs
+     * and 0 if it is constant, so its correlations are NA */
+    double *z = (double *) R_alloc(n * p, sizeof(double));
+    double *scale = (double *) R_alloc(p, sizeof(double));
+    MY_SIZE_T *scratch = (MY_SIZE_T *) R_alloc(n * nthreads, sizeof(MY_SIZE_T));
+    const double mean = (n + 1) / 2.0;
+    const double ss0 = ((double) n * n * n - n) / 12.0;
+    /* no R API within parallel regions */
+    const double *xd = (type == REALSXP) ? REAL(s_x) : NULL;
+    const int *xi = (type == REALSXP) ? NULL : INTEGER(s_x);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+    for (int j = 0; j < p; ++j) {
+        MY_SIZE_T *indx = scratch + (MY_SIZE_T) FR_THREAD_NUM * n;
+        double *r = z + (MY_SIZE_T) j * n;
+        double sum3 = xd
+            ? fr_rank_column_double_(xd + (MY_SIZE_T) j * n, n,
+                                     sort_method, indx, r)
+            : fr_rank_column_int_(xi + (MY_SIZE_T) j * n, n,
+                                  sort_method, indx, r);
+        double ss = ss0 - sum3 / 12.0;
+        if (sum3 < 0 || ss <= 0) {
+            scale[j] = (sum3 < 0) ? NA_REAL : 0.0;
+            continue;
+        }
+        scale[j] = 1.0 / sqrt(ss);
+        for (MY_SIZE_T i = 0; i < n; ++i)
+            r[i] = (r[i] - mean) * scale[j];
+    }
+
+    SEXP s_cor = PROTECT(allocMatrix(REALSXP, p, p));
+    double *cor = REAL(s_cor);
+    int nb = (p + FR_SPEARMAN_BLOCK - 1) / FR_SPEARMAN_BLOCK;
+    int ntiles = nb * (nb + 1) / 2;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+    for (int t = 0; t < ntiles; ++t) {
+        /* tile t is block row bi and block column bj >= bi */
+        int bi = 0, rem = t;
+        while (rem >= nb - bi) {
+            rem -= nb - bi;
+            ++bi;
+        }
+        int bj = bi + rem;
+        int i0 = bi * FR_SPEARMAN_BLOCK, i1 = i0 + FR_SPEARMAN_BLOCK;
+        int j0 = bj * FR_SPEARMAN_BLOCK, j1 = j0 + FR_SPEARMAN_BLOCK;
+        if (i1 > p) i1 = p;
+        if (j1 > p) j1 = p;
+        for (int j = j0; j < j1; ++j)
+            for (int i = i0; i < i1 && (bi < bj || i <= j); ++i)
+                cor[i + (MY_SIZE_T) j * p] = 0.0;
+        for (MY_SIZE_T k0 = 0; k0 < n; k0 += FR_SPEARMAN_ROWS) {
+            MY_SIZE_T k1 = k0 + FR_SPEARMAN_ROWS;
+            if (k1 > n) k1 = n;
+            for (int j = j0; j < j1; ++j) {
+                if (! (scale[j] > 0)) continue;
+                const double *zj = z + (MY_SIZE_T) j * n;
+                for (int i = i0; i < i1 && (bi < bj || i <= j); ++i) {
+                    if (! (scale[i] > 0)) continue;
+                    const double *zi = z + (MY_SIZE_T) i * n;
+                    double sum = 0.0;
+                    for (MY_SIZE_T k = k0; k < k1; ++k)
+                        sum += zi[k] * zj[k];
+                    cor[i + (MY_SIZE_T) j * p] += sum;
+                }
+            }
+        }
+    }
+
+    /* fill in the lower triangle, the diagonal, and NAs */
+    int nconst = 0;
+    for (int j = 0; j < p; ++j) {
+        if (! (scale[j] > 0)) {
+            for (int i = 0; i < p; ++i)
+                cor[i + (MY_SIZE_T) j * p] = cor[j + (MY_SIZE_T) i * p] = NA_REAL;
+            if (scale[j] == 0) ++nconst;
+            continue;
+        }
+        for (int i = 0; i < j; ++i) {
+            if (! (scale[i] > 0)) continue;
+            double c = cor[i + (MY_SIZE_T) j * p];
+            if (c > 1.0) c = 1.0;
+            else if (c < -1.0) c = -1.0;
+            cor[i + (MY_SIZE_T) j * p] = cor[j + (MY_SIZE_T) i * p] = c;
+        }
+        cor[j + (MY_SIZE_T) j * p] = 1.0;
+    }
+    if (nconst > 0)
+        warning("the standard deviation is zero");
+
+    SEXP s_dn = getAttrib(s_x, R_DimNamesSymbol);
+    if (! isNull(s_dn) && ! isNull(VECTOR_ELT(s_dn, 1))) {
+        SEXP s_cdn = PROTECT(allocVector(VECSXP, 2));
+        SET_VECTOR_ELT(s_cdn, 0, VECTOR_ELT(s_dn, 1));
+        SET_VECTOR_ELT(s_cdn, 1, VECTOR_ELT(s_dn, 1));
+        setAttrib(s_cor, R_DimNamesSymbol, s_cdn);
+        UNPROTECT(1);
+    }
+
+    UNPROTECT(1);
+    return s_cor;
+}
+
+
+
+/* QUANTILE NORMALIZATION ******************************************
+ *
+ * Each column is sorted once, in parallel, and its order is kept in its own
+ * column of the result, as doubles, until the reference distribution is
+ * known.  That is the mean over columns of the k-th smallest values, summed
+ * in blocks of FR_QNORM_ROWS rows with the columns in order, so it does not
+ * depend on the number of threads.  Each column is then mapped back through
+ * its ranks by the rank walk with ties averaged, the FR_TO_QNORM target
+ * replacing each rank with the reference value at that rank.  The average
+ * rank of an even number of ties falls halfway between two reference
+ * values, and is given the mean of the two, as in
+ * preprocessCore::normalize.quantiles.
+ */
+
+#define FR_QNORM_ROWS  2048
+
+/* reference value at rank r, a whole number or halfway between two */
+static inline double fr_qnorm_ref_(const double ref[], const double r) {
+    MY_SIZE_T k = (MY_SIZE_T) r;
+    return (r > k) ? (ref[k - 1] + ref[k]) / 2.0 : ref[k - 1];
+}
+
+#define FR_TO_QNORM_AT(_j_) out[indx[_j_]]
+#define FR_TO_QNORM_STORE(_j_, _r_) \
+    FR_TO_QNORM_AT(_j_) = fr_qnorm_ref_(ref, _r_)
+
+/* Sort col[0..n-1] with indx[] as scratch, keeping the order in out[],
+ * returning 0 if there are NAs */
+#define FR_qnorm_sort_column(__SORT, __ISNA) \
+    { \
+    for (MY_SIZE_T i = 0; i < n; ++i) { \
+        if (__ISNA(col[i])) return 0; \
+        indx[i] = i; \
+    } \
+    __SORT(col, indx, n, sort_method); \
+    for (MY_SIZE_T i = 0; i < n; ++i) \
+        out[i] = (double) indx[i]; \
+    return 1; \
+    }
+
+/* Replace the order kept in out[] by the reference values at the ranks of
+ * col[0..n-1], with indx[] as scratch */
+#define FR_qnorm_map_column \
+    { \
+    for (MY_SIZE_T i = 0; i < n; ++i) \
+        indx[i] = (MY_SIZE_T) out[i]; \
+    fr_tie_stats *tstats = NULL; \
+    FR_rank_walk_to(FR_TO_QNORM, FR_ties_average, TYPE, FR_COLUMN, double, n) \
+    }
+
+static int fr_qnorm_sort_int_(const int * col, const MY_SIZE_T n,
+                              const int sort_method, MY_SIZE_T indx[],
+                              double out[]) {
+    FR_qnorm_sort_column(fr_sort_integer_, FR_ISNA_INT)
+}
+
+static int fr_qnorm_sort_double_(const double * col, const MY_SIZE_T n,
+                                 const int sort_method, MY_SIZE_T indx[],
+                                 double out[]) {
+    FR_qnorm_sort_column(fr_sort_double_, FR_ISNA_REAL)
+}
+
+static void fr_qnorm_map_int_(const int * col, const MY_SIZE_T n,
+                              const double ref[], MY_SIZE_T indx[],
+                              double out[]) {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE int
+    FR_qnorm_map_column
+#undef EQUAL
+#undef TYPE
+}
+
+static void fr_qnorm_map_double_(const double * col, const MY_SIZE_T n,
+                                 const double ref[], MY_SIZE_T indx[],
+                                 double out[]) {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE double
+    FR_qnorm_map_column
+#undef EQUAL
+#undef TYPE
+}
+
+/* Quantile normalization of the columns of s_x, called from
+ * fastrank_quantile_normalize() wrapper */
+SEXP fastrank_quantile_normalize_(SEXP s_x, SEXP s_sort, SEXP s_threads) {
+
+    int type = TYPEOF(s_x);
+    if (! isMatrix(s_x) || (type != REALSXP && type != INTSXP && type != LGLSXP))
+        error("'x' must be a logical, integer or numeric matrix");
+    int sort_method = asInteger(s_sort);
+    if (sort_method < 1 || sort_method > 7
+        || (type == REALSXP && sort_method > 1 && sort_method < 5))
+        error("unknown 'sort.method' for 'x'");
+    int nthreads = asInteger(s_threads);
+    if (nthreads == NA_INTEGER || nthreads < 1)
+        nthreads = 1;
+#ifndef _OPENMP
+    nthreads = 1;
+#endif
+
+    MY_SIZE_T n = INTEGER(getAttrib(s_x, R_DimSymbol))[0];
+    int p = INTEGER(getAttrib(s_x, R_DimSymbol))[1];
+
+    SEXP s_out = PROTECT(allocMatrix(REALSXP, n, p));
+    double *out = REAL(s_out);
+    double *ref = (double *) R_alloc(n, sizeof(double));
+    MY_SIZE_T *scratch = (MY_SIZE_T *) R_alloc(n * nthreads, sizeof(MY_SIZE_T));
+    int nna = 0;
+    /* no R API within parallel regions */
+    const double *xd = (type == REALSXP) ? REAL(s_x) : NULL;
+    const int *xi = (type == REALSXP) ? NULL : INTEGER(s_x);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) reduction(+:nna)
+#endif
+    for (int j = 0; j < p; ++j) {
+        MY_SIZE_T *indx = scratch + (MY_SIZE_T) FR_THREAD_NUM * n;
+        double *o = out + (MY_SIZE_T) j * n;
+        int ok = xd
+            ? fr_qnorm_sort_double_(xd + (MY_SIZE_T) j * n, n,
+                                    sort_method, indx, o)
+            : fr_qnorm_sort_int_(xi + (MY_SIZE_T) j * n, n,
+                                 sort_method, indx, o);
+        nna += ! ok;
+    }
+    if (nna > 0)
+        error("'x' must not contain NA or NaN values");
+
+    MY_SIZE_T nblocks = (n + FR_QNORM_ROWS - 1) / FR_QNORM_ROWS;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(static)
+#endif
+    for (MY_SIZE_T b = 0; b < nblocks; ++b) {
+        MY_SIZE_T k0 = b * FR_QNORM_ROWS, k1 = k0 + FR_QNORM_ROWS;
+        if (k1 > n) k1 = n;
+        for (MY_SIZE_T k = k0; k < k1; ++k)
+            ref[k] = 0.0;
+        for (int j = 0; j < p; ++j) {
+            const double *o = out + (MY_SIZE_T) j * n;
+            if (xd) {
+                const double *col = xd + (MY_SIZE_T) j * n;
+                for (MY_SIZE_T k = k0; k < k1; ++k)
+                    ref[k] += col[(MY_SIZE_T) o[k]];
+            } else {
+                const int *col = xi + (MY_SIZE_T) j * n;
+                for (MY_SIZE_T k = k0; k < k1; ++k)
+                    ref[k] += col[(MY_SIZE_T) o[k]];
+            }
+        }
+        for (MY_SIZE_T k = k0; k < k1; ++k)
+            ref[k] /= p;
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+    for (int j = 0; j < p; ++j) {
+        MY_SIZE_T *indx = scratch + (MY_SIZE_T) FR_THREAD_NUM * n;
+        double *o = out + (MY_SIZE_T) j * n;
+        if (xd)
+            fr_qnorm_map_double_(xd + (MY_SIZE_T) j * n, n, ref, indx, o);
+        else
+            fr_qnorm_map_int_(xi + (MY_SIZE_T) j * n, n, ref, indx, o);
+    }
+
+    setAttrib(s_out, R_DimNamesSymbol, getAttrib(s_x, R_DimNamesSymbol));
+    UNPROTECT(1);
+    return s_out;
+}
+
+
+
+/* SPARSE COLUMNS ******************************************
+ *
+ * Sparse columns, as stored in a dgCMatrix, are ranked by sorting only the
+ * stored non-zero values.  The zeros, implicit or stored, are one run of
+ * ties between the negative and positive values, so each column needs only
+ * a count of its negative values and its zeros: the negative values have
+ * the ranks they have among the non-zero values, the zeros share one rank
+ * following them, and the positive values are moved up past the zeros by
+ * the FR_TO_SPARSE target.  A run of tied non-zero values never spans the
+ * zeros, so this works for every ties.method that gives tied values the
+ * same rank.  NAs and NaNs are ranked NA and not counted, as for
+ * rank(..., na.last = "keep").
+ */
+
+#define FR_TO_SPARSE_AT(_j_) ranks[indx[_j_]]
+#define FR_TO_SPARSE_STORE(_j_, _r_) \
+    FR_TO_SPARSE_AT(_j_) = (_r_) + ((_j_) < nneg ? 0 : nzero)
+
+#define FR_sparse_walk(__TIES__) \
+    FR_rank_walk_to(FR_TO_SPARSE, __TIES__, double, FR_COLUMN, double, nnz)
+
+/* Ranks of sparse columns with column pointers s_p into the stored values
+ * s_x of columns of length s_n, as list(ranks, zero) of the ranks of the
+ * stored values and the rank shared by the zeros in each column, called
+ * from fastrank_sparse() wrapper */
+SEXP fastrank_sparse_(SEXP s_p, SEXP s_x, SEXP s_n, SEXP s_tm, SEXP s_sort) {
+
+    if (TYPEOF(s_p) != INTSXP || LENGTH(s_p) < 1 || TYPEOF(s_x) != REALSXP)
+        error("'x' must be a dgCMatrix or a numeric vector");
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    if (ties_method != TIES_AVERAGE && ties_method != TIES_MAX
+        && ties_method != TIES_MIN)
+        error("'ties.method' must be \"average\", \"max\" or \"min\" for sparse ranking");
+    int sort_method = asInteger(s_sort);
+    if (sort_method != 1 && (sort_method < 5 || sort_method > 7))
+        error("unknown 'sort.method' for 'x'");
+    double dn = asReal(s_n);
+    if (! R_FINITE(dn) || dn < 0)
+        error("'n' must be a non-negative number");
+
+    const MY_SIZE_T n = (MY_SIZE_T) dn;
+    const int ncol = LENGTH(s_p) - 1;
+    const int *p = INTEGER(s_p);
+    const double *val = REAL(s_x);
+    MY_SIZE_T maxk = 0;
+    if (p[0] != 0 || p[ncol] != MY_LENGTH(s_x))
+        error("column pointers do not match the stored values");
+    for (int c = 0; c < ncol; ++c) {
+        MY_SIZE_T k = p[c + 1] - p[c];
+        if (k < 0 || k > n)
+            error("column pointers do not match the stored values");
+        if (k > maxk)
+            maxk = k;
+    }
+
+    SEXP s_ranks = PROTECT(allocVector(REALSXP, MY_LENGTH(s_x)));
+    SEXP s_zero = PROTECT(allocVector(REALSXP, ncol));
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(maxk, sizeof(MY_SIZE_T));
+    fr_tie_stats *tstats = NULL;
+
+    for (int c = 0; c < ncol; ++c) {
+        const double *col = val + p[c];
+        double *ranks = REAL(s_ranks) + p[c];
+        const MY_SIZE_T k = p[c + 1] - p[c];
+        MY_SIZE_T nnz = 0, nneg = 0, nzero = n - k;
+        for (MY_SIZE_T i = 0; i < k; ++i) {
+            if (ISNAN(col[i])) {
+                ranks[i] = NA_REAL;
+            } else if (col[i] == 0.0) {
+                ++nzero;
+            } else {
+                indx[nnz++] = i;
+                nneg += (col[i] < 0.0);
+            }
+        }
+        double zero = NA_REAL;
+        if (nzero > 0) {
+            switch (ties_method) {
+            case TIES_AVERAGE: zero = nneg + (nzero + 1) / 2.0; break;
+            case TIES_MAX:     zero = (double) (nneg + nzero);  break;
+            case TIES_MIN:     zero = (double) (nneg + 1);      break;
+            default: break;
+            }
+        }
+        REAL(s_zero)[c] = zero;
+        for (MY_SIZE_T i = 0; i < k; ++i)
+            if (col[i] == 0.0)
+                ranks[i] = zero;
+        if (nnz == 0)
+            continue;
+        fr_sort_double_(col, indx, nnz, sort_method);
+
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE double
+        switch (ties_method) {
+        case TIES_AVERAGE:
+            FR_sparse_walk(FR_ties_average)
+            break;
+        case TIES_MAX:
+            FR_sparse_walk(FR_ties_max)
+            break;
+        case TIES_MIN:
+            FR_sparse_walk(FR_ties_min)
+            break;
+        default:
+            break;
+        }
+#undef EQUAL
+#undef TYPE
+    }
+
+    SEXP s_ans = PROTECT(allocVector(VECSXP, 2));
+    SEXP s_names = PROTECT(allocVector(STRSXP, 2));
+    SET_VECTOR_ELT(s_ans, 0, s_ranks);
+    SET_VECTOR_ELT(s_ans, 1, s_zero);
+    SET_STRING_ELT(s_names, 0, mkChar("ranks"));
+    SET_STRING_ELT(s_names, 1, mkChar("zero"));
+    setAttrib(s_ans, R_NamesSymbol, s_names);
+    UNPROTECT(4);
+    return s_ans;
+}
+
+
+
+/* KENDALL'S TAU ******************************************
+ *
+ * Knight's algorithm for tau-b in O(n log n).  Positions are sorted by x
+ * with the index sort kernels, and each run of ties in x is then sorted by
+ * y, so the discordant pairs are the swaps made by a merge sort of the y
+ * values taken in that order.  Pairs tied in x, in y, and in both are
+ * counted from the runs of equal values along the way.
+ */
+
+/* Copy s_x to doubles, returning NULL if it has any NA */
+static double * fr_as_double_(SEXP s_x, const MY_SIZE_T n) {
+    double *d = (double *) R_alloc(n, sizeof(double));
+    if (TYPEOF(s_x) == REALSXP) {
+        const double *x = REAL(s_x);
+        for (MY_SIZE_T i = 0; i < n; ++i) {
+            if (FR_ISNA_REAL(x[i])) return NULL;
+            d[i] = x[i];
+        }
+    } else {
+        const int *x = INTEGER(s_x);
+        for (MY_SIZE_T i = 0; i < n; ++i) {
+            if (FR_ISNA_INT(x[i])) return NULL;
+            d[i] = (double) x[i];
+        }
+    }
+    return d;
+}
+
+/* Number of pairs of tied values in the runs of v[0..n-1], which is sorted
+ * at least so that equal values are adjacent */
+static double fr_tied_pairs_(const double v[], const MY_SIZE_T n) {
+    double pairs = 0.0;
+    MY_SIZE_T ib = 0;
+    for (MY_SIZE_T i = 1; i <= n; ++i) {
+        if (i == n || v[i] != v[ib]) {
+            double t = (double)(i - ib);
+            pairs += t * (t - 1) / 2.0;
+            ib = i;
+        }
+    }
+    return pairs;
+}
+
+/* Stable bottom-up merge sort of a[0..n-1] with aux[] as scratch, returning
+ * the number of swaps, that is of pairs out of order */
+static double fr_mergesort_swaps_(double a[], double aux[], const MY_SIZE_T n) {
+    double swaps = 0.0;
+    double *src = a, *dst = aux;
+    for (MY_SIZE_T w = 1; w < n; w *= 2) {
+        for (MY_SIZE_T lo = 0; lo < n; lo += 2 * w) {
+            MY_SIZE_T mid = (lo + w < n) ? lo + w : n;
+            MY_SIZE_T hi = (lo + 2 * w < n) ? lo + 2 * w : n;
+            MY_SIZE_T i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                if (src[j] < src[i]) {
+                    swaps += (double)(mid - i);
+                    dst[k++] = src[j++];
+                } else {
+                    dst[k++] = src[i++];
+                }
+            }
+            while (i < mid) dst[k++] = src[i++];
+            while (j < hi) dst[k++] = src[j++];
+        }
+        SWAP(double *, src, dst);
+    }
+    if (src != a)
+        memcpy(a, src, n * sizeof(double));
+    return swaps;
+}
+
+/* Kendall's tau-b of s_x and s_y, as returned by cor(x, y, method =
+ * "kendall"), called from fastrank_kendall() wrapper */
+SEXP fastrank_kendall_(SEXP s_x, SEXP s_y, SEXP s_sort) {
+
+    int tx = fr_typeof_(s_x), ty = fr_typeof_(s_y);
+    if ((tx != REALSXP && tx != INTSXP && tx != LGLSXP)
+        || (ty != REALSXP && ty != INTSXP && ty != LGLSXP))
+        error("'x' and 'y' must be logical, integer or numeric vectors");
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    if (MY_LENGTH(s_y) != n)
+        error("'x' and 'y' must have the same length");
+    int sort_method = fr_sort_method_(s_sort);
+
+    double *dx = fr_as_double_(s_x, n), *dy = fr_as_double_(s_y, n);
+    if (n < 2 || ! dx || ! dy)
+        return ScalarReal(NA_REAL);
+
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    for (MY_SIZE_T i = 0; i < n; ++i) indx[i] = i;
+    fr_sort_index_(s_x, indx, n, sort_method);
+
+    /* sort each run of ties in x by y, counting pairs tied in x, and in both
+     * x and y */
+    double *v = (double *) R_alloc(n, sizeof(double));
+    double n1 = 0.0, n3 = 0.0;
+    MY_SIZE_T ib = 0;
+    for (MY_SIZE_T i = 1; i <= n; ++i) {
+        if (i < n && dx[indx[i]] == dx[indx[ib]])
+            continue;
+        MY_SIZE_T t = i - ib;
+        if (t > 1) {
+            n1 += (double) t * (t - 1) / 2.0;
+            fr_sort_index_(s_y, indx + ib, t, sort_method);
+        }
+        for (MY_SIZE_T j = ib; j < i; ++j)
+            v[j] = dy[indx[j]];
+        if (t > 1)
+            n3 += fr_tied_pairs_(v + ib, t);
+        ib = i;
+    }
+
+    double *aux = (double *) R_alloc(n, sizeof(double));
+    double swaps = fr_mergesort_swaps_(v, aux, n);
+    double n2 = fr_tied_pairs_(v, n);
+
+    double n0 = (double) n * (n - 1) / 2.0;
+    double denom = sqrt((n0 - n1) * (n0 - n2));
+    if (denom == 0.0) {
+        warning("the standard deviation is zero");
+        return ScalarReal(NA_REAL);
+    }
+    return ScalarReal((n0 - n1 - n2 + n3 - 2.0 * swaps) / denom);
+}
+
+
+
+/* MULTIPLE KEYS ******************************************
+ *
+ * Rows are ranked lexicographically by several keys, as order(x, y, ...)
+ * orders them, generalizing the sort-and-refine used for complex values.
+ * Starting from a single run holding all rows, each run of ties so far is
+ * sorted by the next key and split into runs of ties on it, and the final
+ * runs are ranked by fr_rank_runs_ without comparing values again.  Keys
+ * stop being applied once every run holds a single row.  Character keys are
+ * replaced by their ranks in C-locale order before sorting, and complex
+ * keys are split into real and imaginary parts once, not for every run.
+ * Earlier keys can leave many short runs, so runs shorter than
+ * QUICKSORT_INSERTION_CUTOFF are insertion sorted in place, and scratch
+ * for longer ones is released after each run.
+ */
+
+#define FR_mark_na(__TYPE, __TCONV, __ISNA) \
+    { \
+    const __TYPE* x = __TCONV(s_key); \
+    for (MY_SIZE_T i = 0; i < n; ++i) \
+        if (__ISNA(x[i])) isna[i] = 1; \
+    }
+
+#define FR_split_runs(__TYPE, __TCONV, __SORT) \
+    { \
+    const __TYPE* x = __TCONV(s_key); \
+    for (MY_SIZE_T r = 0; r < nruns; ++r) { \
+        MY_SIZE_T ib = runs[r], ie = runs[r + 1]; \
+        newruns[nr++] = ib; \
+        if (ie - ib < 2) continue; \
+        if (ie - ib <= QUICKSORT_INSERTION_CUTOFF) { \
+            for (MY_SIZE_T i = ib + 1; i < ie; ++i) { \
+                MY_SIZE_T it = indx[i], j = i; \
+                for (; j > ib && LESSER(x[it], XI(j - 1)); --j) \
+                    indx[j] = indx[j - 1]; \
+                indx[j] = it; \
+            } \
+        } else { \
+            const void *vmax = vmaxget(); \
+            __SORT; \
+            vmaxset(vmax); \
+        } \
+        for (MY_SIZE_T i = ib + 1; i < ie; ++i) \
+            if (! EQUAL(XI(i), XI(i - 1))) newruns[nr++] = i; \
+    } \
+    }
+
+/* Sort each of the nruns runs in runs[] by s_key, writing the runs of ties
+ * that result to newruns[] and returning their number.  re[] and im[] are
+ * the parts of a complex key */
+static MY_SIZE_T fr_split_runs_(SEXP s_key, const double * re,
+                                const double * im, MY_SIZE_T indx[],
+                                const MY_SIZE_T runs[], const MY_SIZE_T nruns,
+                                MY_SIZE_T newruns[], const int sort_method) {
+    MY_SIZE_T nr = 0;
+    switch (fr_typeof_(s_key)) {
+    case LGLSXP:
+    case INTSXP:
+#define EQUAL(_x, _y) (_x == _y)
+#define LESSER(_x, _y) (_x < _y)
+        FR_split_runs(int, INTEGER,
+                      fr_sort_integer_(x, indx + ib, ie - ib, sort_method))
+#undef LESSER
+#undef EQUAL
+        break;
+    case REALSXP:
+#define EQUAL(_x, _y) (_x == _y)
+#define LESSER(_x, _y) (_x < _y)
+        FR_split_runs(double, REAL,
+                      fr_sort_double_(x, indx + ib, ie - ib, sort_method))
+#undef LESSER
+#undef EQUAL
+        break;
+    case CPLXSXP:
+#define EQUAL(_x, _y) __CPLX_EQUAL(_x, _y)
+#define LESSER(_x, _y) ((_x).r < (_y).r || ((_x).r == (_y).r && (_x).i < (_y).i))
+        FR_split_runs(Rcomplex, COMPLEX,
+                      fr_sort_complex_parts_(re, im, indx + ib, ie - ib,
+                                             sort_method))
+#undef LESSER
+#undef EQUAL
+        break;
+    case INT64SXP:
+#define EQUAL(_x, _y) (_x == _y)
+#define LESSER(_x, _y) (_x < _y)
+        FR_split_runs(int64_t, FR_INT64,
+                      fr_radixsort_int64_i_(x, indx + ib, ie - ib))
+#undef LESSER
 #undef EQUAL
-#undef TYPE
-#undef TCONV
-        }
         break;
-#endif
     default:
-        error("'x' is not a logical, integer, numeric or complex vector");
+        error("unsupported type for key");
         break;
     }
+    newruns[nr] = runs[nruns];
+    return nr;
+}
 
-    UNPROTECT(1);
+/* Rank rows by the keys in the list s_keys, called from fastrank_multi()
+ * wrapper.  Rows with an NA in any key are NA, ranked following na_last */
+SEXP fastrank_multi_(SEXP s_keys, SEXP s_tm, SEXP s_sort, SEXP s_na) {
+
+    if (TYPEOF(s_keys) != VECSXP || LENGTH(s_keys) == 0)
+        error("'keys' must be a list of one or more vectors");
+    int nkeys = LENGTH(s_keys);
+    MY_SIZE_T n = MY_LENGTH(VECTOR_ELT(s_keys, 0));
+    int sort_method = fr_sort_method_(s_sort);
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    fr_na_t na_last = fr_na_last_(s_na);
+
+    /* the keys to sort by, with character keys replaced by their ranks, and
+     * the rows with any NA key */
+    SEXP s_k = PROTECT(allocVector(VECSXP, nkeys));
+    const double **re = (const double **) R_alloc(nkeys, sizeof(double *));
+    const double **im = (const double **) R_alloc(nkeys, sizeof(double *));
+    char *isna = (char *) R_alloc(n, sizeof(char));
+    memset(isna, 0, n);
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
+    for (int k = 0; k < nkeys; ++k) {
+        SEXP s_key = VECTOR_ELT(s_keys, k);
+        if (MY_LENGTH(s_key) != n)
+            error("all keys must have the same length");
+        re[k] = im[k] = NULL;
+        switch (fr_typeof_(s_key)) {
+        case LGLSXP:
+        case INTSXP:
+            FR_mark_na(int, INTEGER, FR_ISNA_INT)
+            break;
+        case REALSXP:
+            FR_mark_na(double, REAL, FR_ISNA_REAL)
+            break;
+        case CPLXSXP:
+            FR_mark_na(Rcomplex, COMPLEX, FR_ISNA_CPLX)
+            {
+            double *kre = (double *) R_alloc(n, sizeof(double));
+            double *kim = (double *) R_alloc(n, sizeof(double));
+            for (MY_SIZE_T i = 0; i < n; ++i) {
+                kre[i] = COMPLEX(s_key)[i].r;
+                kim[i] = COMPLEX(s_key)[i].i;
+            }
+            re[k] = kre;
+            im[k] = kim;
+            }
+            break;
+        case INT64SXP:
+            FR_mark_na(int64_t, FR_INT64, FR_ISNA_INT64)
+            break;
+        case STRSXP:
+            {
+            MY_SIZE_T nn = fr_init_index_na_(s_key, indx, n);
+            SEXP s_codes = PROTECT(fr_rank_string_(s_key, indx, n, nn,
+                                                   TIES_MIN, NULL));
+            for (MY_SIZE_T j = nn; j < n; ++j) {
+                INTEGER(s_codes)[indx[j]] = NA_INTEGER;
+                isna[indx[j]] = 1;
+            }
+            SET_VECTOR_ELT(s_k, k, s_codes);
+            UNPROTECT(1);
+            continue;
+            }
+        default:
+            error("keys must be logical, integer, numeric, complex or character vectors");
+            break;
+        }
+        SET_VECTOR_ELT(s_k, k, s_key);
+    }
+
+    /* rows without NAs first, then those with NAs in their original order */
+    MY_SIZE_T nn = 0, hi = n;
+    for (MY_SIZE_T i = 0; i < n; ++i) {
+        if (isna[i]) indx[--hi] = i;
+        else indx[nn++] = i;
+    }
+    for (MY_SIZE_T j = n - 1; hi < j; ++hi, --j)
+        SWAP(MY_SIZE_T, indx[hi], indx[j]);
+
+    MY_SIZE_T *runs = (MY_SIZE_T *) R_alloc(nn + 1, sizeof(MY_SIZE_T));
+    MY_SIZE_T *newruns = (MY_SIZE_T *) R_alloc(nn + 1, sizeof(MY_SIZE_T));
+    MY_SIZE_T nruns = 0;
+    runs[0] = 0;
+    if (nn > 0) {
+        runs[1] = nn;
+        nruns = 1;
+    }
+    for (int k = 0; k < nkeys && nruns < nn; ++k) {
+        nruns = fr_split_runs_(VECTOR_ELT(s_k, k), re[k], im[k], indx, runs,
+                               nruns, newruns, sort_method);
+        SWAP(MY_SIZE_T *, runs, newruns);
+    }
+
+    /* rows tied on all keys are in their original order for "first" */
+    if (ties_method == TIES_FIRST)
+        for (MY_SIZE_T r = 0; r < nruns; ++r)
+            if (runs[r + 1] - runs[r] > 1)
+                qsort(indx + runs[r], runs[r + 1] - runs[r],
+                      sizeof(MY_SIZE_T), fr_cmp_index_);
+
+    SEXP s_ranks = PROTECT(fr_rank_runs_(indx, runs, nruns, n, ties_method,
+                                         NULL));
+    s_ranks = fr_rank_na_(s_ranks, indx, n, nn, na_last);
+
+    UNPROTECT(2);
     return s_ranks;
 }
 
@@ -757,7 +2749,12 @@ SEXP fastrank_(SEXP s_x, SEXP s_tm, SEXP s_sort) {
 
 SEXP fastrank_average_(SEXP s_x) {
 
+    if (fr_typeof_(s_x) == INT64SXP)
+        error("integer64 'x' is not supported, use fastrank()");
+
     MY_SIZE_T n = MY_LENGTH(s_x);
+    MY_SIZE_T nn = n;  /* NAs are not checked */
+    fr_tie_stats *tstats = NULL;
 
     MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T));
     for (MY_SIZE_T i = 0; i < n; ++i) indx[i] = i;
@@ -796,18 +2793,16 @@ SEXP fastrank_average_(SEXP s_x) {
 #undef TYPE
 #undef TCONV
         break;
-#if 0
     case CPLXSXP:
 #define EQUAL(_x, _y) __CPLX_EQUAL(_x, _y)
 #define TYPE Rcomplex
 #define TCONV COMPLEX
+        fr_sort_complex_(TCONV(s_x), n, indx, n, 7);  /* as for the others */
         FR_rank(FR_ties_average, TYPE, TCONV, double, REALSXP, REAL)
-        break;
 #undef EQUAL
 #undef TYPE
 #undef TCONV
         break;
-#endif
     default:
         error("'x' is not a logical, integer, numeric or complex vector");
         break;
@@ -876,3 +2871,927 @@ SEXP fastrank_num_avg_(SEXP s_x) {
     return s_ranks;
 }
 
+
+/* Direct entries for each ties method, generated from the same kernels as
+ * fastrank_ so they can skip its checks and switches.  The vector must not
+ * contain NAs.  Ties are broken with "first" by position, as rank does.
+ * They sort with the 3-way quicksort of sort.method 7, whose median-of-three
+ * pivot keeps presorted vectors from being quadratic */
+#define FR_direct(__NAME, __TIES__, __TYPE, __TCONV, __SORT, __RTYPE, \
+                  __R_RTYPE, __R_TCONV, __CHECK, __PREP) \
+SEXP __NAME(SEXP s_x) { \
+    if (! (__CHECK)) \
+        error("type of 'x' not supported"); \
+    MY_SIZE_T n = MY_LENGTH(s_x); \
+    MY_SIZE_T nn = n;  /* NAs are not checked */ \
+    fr_tie_stats *tstats = NULL; \
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(n, sizeof(MY_SIZE_T)); \
+    for (MY_SIZE_T i = 0; i < n; ++i) indx[i] = i; \
+    __SORT(__TCONV(s_x), indx, n, QUICKSORT3WAY_INSERTION_CUTOFF); \
+    SEXP s_ranks = NULL; \
+    __PREP \
+    FR_rank(__TIES__, __TYPE, __TCONV, __RTYPE, __R_RTYPE, __R_TCONV) \
+    UNPROTECT(1); \
+    return s_ranks; \
+}
+
+#define FR_IS_INTEGER (TYPEOF(s_x) == INTSXP || TYPEOF(s_x) == LGLSXP) \
+                      && fr_typeof_(s_x) != INT64SXP
+#define FR_IS_NUMERIC TYPEOF(s_x) == REALSXP && fr_typeof_(s_x) != INT64SXP
+
+#define EQUAL(_x, _y) (_x == _y)
+FR_direct(fastrank_integer_average_, FR_ties_average, int, INTEGER,
+          fr_quicksort3way_integer2_i_, double, REALSXP, REAL,
+          FR_IS_INTEGER, )
+FR_direct(fastrank_integer_first_, FR_ties_first, int, INTEGER,
+          fr_quicksort3way_integer2_i_, int, INTSXP, INTEGER,
+          FR_IS_INTEGER, FR_stable_runs(int, INTEGER))
+FR_direct(fastrank_integer_random_, FR_ties_random, int, INTEGER,
+          fr_quicksort3way_integer2_i_, int, INTSXP, INTEGER,
+          FR_IS_INTEGER, FR_RNG_SEED)
+FR_direct(fastrank_integer_max_, FR_ties_max, int, INTEGER,
+          fr_quicksort3way_integer2_i_, int, INTSXP, INTEGER,
+          FR_IS_INTEGER, )
+FR_direct(fastrank_integer_min_, FR_ties_min, int, INTEGER,
+          fr_quicksort3way_integer2_i_, int, INTSXP, INTEGER,
+          FR_IS_INTEGER, )
+FR_direct(fastrank_numeric_first_, FR_ties_first, double, REAL,
+          fr_quicksort3way_double2_i_, int, INTSXP, INTEGER,
+          FR_IS_NUMERIC, FR_stable_runs(double, REAL))
+FR_direct(fastrank_numeric_random_, FR_ties_random, double, REAL,
+          fr_quicksort3way_double2_i_, int, INTSXP, INTEGER,
+          FR_IS_NUMERIC, FR_RNG_SEED)
+FR_direct(fastrank_numeric_max_, FR_ties_max, double, REAL,
+          fr_quicksort3way_double2_i_, int, INTSXP, INTEGER,
+          FR_IS_NUMERIC, )
+FR_direct(fastrank_numeric_min_, FR_ties_min, double, REAL,
+          fr_quicksort3way_double2_i_, int, INTSXP, INTEGER,
+          FR_IS_NUMERIC, )
+#undef EQUAL
+
+
+
+/* RANK INDEX ******************************************
+ *
+ * A rank index keeps the products of the sort phase -- the sorted index, the
+ * values in sorted order, and the boundaries of runs of equal values -- so
+ * that ranks for any ties.method can be produced later without sorting
+ * again.  Everything lives in one block laid out exactly as it is written to
+ * disk, so a saved index can be mmap()ed read-only and shared between every
+ * process that opens it, e.g., parallel::mclapply workers.
+ *
+ * Block layout, each section padded to a multiple of 8 bytes:
+ *
+ *     fr_index_header
+ *     MY_SIZE_T indx[n]            as for fastrank_, NAs in indx[nn..n-1]
+ *     int or double keys[n]        keys[i] == x[indx[i]]
+ *     MY_SIZE_T runs[nruns + 1]    runs[r] is the start of run r in indx[]
+ *
+ * Only the nn non-NA values are sorted and in runs, and the positions of
+ * NAs and NaNs follow them in indx[] in order of appearance, so ranks can be
+ * given to them following na.last when ranks are produced.
+ *
+ * The runs section is last so it can be added with a realloc once the number
+ * of runs is known.  Positions within each run are in increasing order, so
+ * ranks for "first" follow order of appearance.  Files are only portable between builds with the same
+ * MY_SIZE_T and byte order, which is checked when loading.
+ */
+
+#define FR_INDEX_MAGIC    "FRANKIDX"
+#define FR_INDEX_VERSION  2
+#define FR_PAD8(__S)      (((size_t)(__S) + 7) & ~((size_t)7))
+
+typedef struct {
+    char    magic[8];
+    int32_t version;
+    int32_t type;          /* INTSXP or REALSXP */
+    int32_t size_t_size;   /* sizeof(MY_SIZE_T) of the writer */
+    int32_t byte_order;    /* 1, as written by the writer */
+    int64_t n;
+    int64_t nruns;
+    int64_t nn;            /* number of non-NA values */
+    int64_t reserved[2];   /* pad header to 64 bytes */
+} fr_index_header;
+
+typedef struct {
+    fr_index_header *hdr;    /* start of the block */
+    size_t           size;   /* size of the block in bytes */
+    int              mapped; /* is the block mmap()ed from a file? */
+    MY_SIZE_T       *indx;
+    void            *keys;
+    MY_SIZE_T       *runs;
+} fr_index;
+
+
+static size_t fr_index_size_(const int type, const MY_SIZE_T n,
+                             const MY_SIZE_T nruns) {
+    size_t key_size = (type == REALSXP) ? sizeof(double) : sizeof(int);
+    return sizeof(fr_index_header)
+        + FR_PAD8(n * sizeof(MY_SIZE_T))
+        + FR_PAD8(n * key_size)
+        + FR_PAD8((nruns + 1) * sizeof(MY_SIZE_T));
+}
+
+/* set section pointers from the header at the start of the block */
+static void fr_index_layout_(fr_index *ix) {
+    MY_SIZE_T n = (MY_SIZE_T) ix->hdr->n;
+    size_t key_size = (ix->hdr->type == REALSXP) ? sizeof(double) : sizeof(int);
+    char *p = (char *) ix->hdr + sizeof(fr_index_header);
+    ix->indx = (MY_SIZE_T *) p;
+    p += FR_PAD8(n * sizeof(MY_SIZE_T));
+    ix->keys = (void *) p;
+    p += FR_PAD8(n * key_size);
+    ix->runs = (MY_SIZE_T *) p;
+}
+
+static void fr_index_release_(fr_index *ix) {
+    if (ix->hdr == NULL)
+        return;
+#ifndef _WIN32
+    if (ix->mapped)
+        munmap((void *) ix->hdr, ix->size);
+    else
+#endif
+        free(ix->hdr);
+    ix->hdr = NULL;
+}
+
+static void fr_index_finalize_(SEXP s_ix) {
+    fr_index *ix = (fr_index *) R_ExternalPtrAddr(s_ix);
+    if (ix == NULL)
+        return;
+    fr_index_release_(ix);
+    free(ix);
+    R_ClearExternalPtr(s_ix);
+}
+
+/* wrap a new, empty fr_index in an external pointer that frees it when
+ * collected, so it is not leaked if we error() while filling it */
+static SEXP fr_index_wrap_(fr_index **ixp) {
+    fr_index *ix = (fr_index *) calloc(1, sizeof(fr_index));
+    if (ix == NULL)
+        error("unable to allocate rank index");
+    SEXP s_ix = PROTECT(R_MakeExternalPtr(ix, install("fastrank_index"),
+                                          R_NilValue));
+    R_RegisterCFinalizerEx(s_ix, fr_index_finalize_, TRUE);
+    setAttrib(s_ix, R_ClassSymbol, mkString("fastrank_index"));
+    UNPROTECT(1);
+    *ixp = ix;
+    return s_ix;
+}
+
+static fr_index *fr_index_get_(SEXP s_ix) {
+    if (TYPEOF(s_ix) != EXTPTRSXP
+        || R_ExternalPtrTag(s_ix) != install("fastrank_index"))
+        error("'index' is not a fastrank_index");
+    fr_index *ix = (fr_index *) R_ExternalPtrAddr(s_ix);
+    if (ix == NULL || ix->hdr == NULL)
+        error("'index' is no longer valid, was it saved in a previous session?");
+    return ix;
+}
+
+static void fr_index_check_header_(const fr_index_header *hdr,
+                                   const size_t file_size) {
+    if (file_size < sizeof(fr_index_header)
+        || memcmp(hdr->magic, FR_INDEX_MAGIC, 8) != 0)
+        error("file is not a fastrank index");
+    if (hdr->version != FR_INDEX_VERSION)
+        error("fastrank index version %d not supported", (int) hdr->version);
+    if (hdr->size_t_size != (int32_t) sizeof(MY_SIZE_T) || hdr->byte_order != 1)
+        error("fastrank index was written on an incompatible platform");
+    if (hdr->type != INTSXP && hdr->type != REALSXP)
+        error("fastrank index has unknown type");
+    if (hdr->n < 0 || hdr->nn < 0 || hdr->nn > hdr->n
+        || hdr->nruns < 0 || hdr->nruns > hdr->nn
+        || fr_index_size_(hdr->type, (MY_SIZE_T) hdr->n,
+                          (MY_SIZE_T) hdr->nruns) != file_size)
+        error("fastrank index file is truncated or corrupt");
+}
+
+/* check the sections of a loaded index, so a corrupt file cannot send us
+ * outside the block: runs[] must rise strictly from 0 to nn, and indx[] must
+ * be a permutation of 0..n-1 that increases within each run and within the
+ * NAs that follow the runs */
+static void fr_index_check_block_(const fr_index *ix) {
+    const MY_SIZE_T n = (MY_SIZE_T) ix->hdr->n;
+    const MY_SIZE_T nn = (MY_SIZE_T) ix->hdr->nn;
+    const MY_SIZE_T nruns = (MY_SIZE_T) ix->hdr->nruns;
+    const MY_SIZE_T *indx = ix->indx, *runs = ix->runs;
+    if ((nn > 0 && (nruns == 0 || runs[0] != 0)) || runs[nruns] != nn)
+        error("fastrank index file is truncated or corrupt");
+    for (MY_SIZE_T r = 0; r < nruns; ++r)
+        if (runs[r + 1] <= runs[r])
+            error("fastrank index file is truncated or corrupt");
+    unsigned char *seen = (unsigned char *) R_alloc(n / 8 + 1, 1);
+    memset(seen, 0, n / 8 + 1);
+    for (MY_SIZE_T r = 0; r < nruns; ++r) {
+        for (MY_SIZE_T i = runs[r]; i < runs[r + 1]; ++i) {
+            MY_SIZE_T k = indx[i];
+            if (k < 0 || k >= n || (i > runs[r] && k <= indx[i - 1])
+                || (seen[k >> 3] & (1 << (k & 7))))
+                error("fastrank index file is truncated or corrupt");
+            seen[k >> 3] |= (unsigned char)(1 << (k & 7));
+        }
+    }
+    for (MY_SIZE_T i = nn; i < n; ++i) {
+        MY_SIZE_T k = indx[i];
+        if (k < 0 || k >= n || (i > nn && k <= indx[i - 1])
+            || (seen[k >> 3] & (1 << (k & 7))))
+            error("fastrank index file is truncated or corrupt");
+        seen[k >> 3] |= (unsigned char)(1 << (k & 7));
+    }
+}
+
+
+
+/* Sort x and keep the results in a rank index, with runs over the nn
+ * non-NA values */
+#define FR_index_build(__TYPE, __TCONV) \
+    { \
+    __TYPE* x = __TCONV(s_x); \
+    __TYPE* keys = (__TYPE *) ix->keys; \
+    MY_SIZE_T nruns = (nn > 0) ? 1 : 0; \
+    for (MY_SIZE_T i = 0; i < n; ++i) { \
+        keys[i] = XI(i); \
+        if (i > 0 && i < nn && ! EQUAL(keys[i], keys[i - 1])) ++nruns; \
+    } \
+    size = fr_index_size_(ix->hdr->type, n, nruns); \
+    fr_index_header *hdr = (fr_index_header *) realloc(ix->hdr, size); \
+    if (hdr == NULL) \
+        error("unable to allocate rank index runs"); \
+    ix->hdr = hdr; \
+    ix->size = size; \
+    hdr->nruns = nruns; \
+    fr_index_layout_(ix); \
+    keys = (__TYPE *) ix->keys; \
+    MY_SIZE_T r = 0; \
+    if (nn > 0) ix->runs[r++] = 0; \
+    for (MY_SIZE_T i = 1; i < nn; ++i) { \
+        if (! EQUAL(keys[i], keys[i - 1])) ix->runs[r++] = i; \
+    } \
+    ix->runs[nruns] = nn; \
+    for (r = 0; r < nruns; ++r) { \
+        MY_SIZE_T t = ix->runs[r + 1] - ix->runs[r]; \
+        if (t > 1) \
+            qsort(ix->indx + ix->runs[r], t, sizeof(MY_SIZE_T), fr_cmp_index_); \
+    } \
+    }
+
+SEXP fastrank_index_(SEXP s_x, SEXP s_sort) {
+
+    if (TYPEOF(s_x) != REALSXP && TYPEOF(s_x) != INTSXP && TYPEOF(s_x) != LGLSXP)
+        error("'x' is not a logical, integer or numeric vector");
+    if (fr_typeof_(s_x) == INT64SXP)
+        error("integer64 'x' is not supported by rank indexes");
+
+    int sort_method = fr_sort_method_(s_sort);
+    MY_SIZE_T n = MY_LENGTH(s_x);
+    int type = (TYPEOF(s_x) == REALSXP) ? REALSXP : INTSXP;
+
+    fr_index *ix;
+    SEXP s_ix = PROTECT(fr_index_wrap_(&ix));
+
+    /* block without runs, they are added once they are counted */
+    size_t size = fr_index_size_(type, n, 0);
+    ix->hdr = (fr_index_header *) calloc(1, size);
+    if (ix->hdr == NULL)
+        error("unable to allocate rank index");
+    ix->size = size;
+    memcpy(ix->hdr->magic, FR_INDEX_MAGIC, 8);
+    ix->hdr->version = FR_INDEX_VERSION;
+    ix->hdr->type = type;
+    ix->hdr->size_t_size = (int32_t) sizeof(MY_SIZE_T);
+    ix->hdr->byte_order = 1;
+    ix->hdr->n = (int64_t) n;
+    fr_index_layout_(ix);
+
+    /* NAs are partitioned to the end and not sorted */
+    MY_SIZE_T *indx = ix->indx;
+    MY_SIZE_T nn = fr_init_index_na_(s_x, indx, n);
+    ix->hdr->nn = (int64_t) nn;
+    fr_sort_index_(s_x, indx, nn, sort_method);
+
+    switch (type) {
+    case INTSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_index_build(int, INTEGER)
+#undef EQUAL
+        break;
+    case REALSXP:
+#define EQUAL(_x, _y) (_x == _y)
+        FR_index_build(double, REAL)
+#undef EQUAL
+        break;
+    }
+
+    UNPROTECT(1);
+    return s_ix;
+}
+
+
+
+/* Rank from a rank index, without sorting, with NAs ranked following
+ * na.last */
+SEXP fastrank_index_ranks_(SEXP s_ix, SEXP s_tm, SEXP s_na) {
+
+    fr_index *ix = fr_index_get_(s_ix);
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    fr_na_t na_last = fr_na_last_(s_na);
+    MY_SIZE_T n = (MY_SIZE_T) ix->hdr->n, nn = (MY_SIZE_T) ix->hdr->nn;
+
+    SEXP s_ranks = PROTECT(fr_rank_runs_(ix->indx, ix->runs,
+                                         (MY_SIZE_T) ix->hdr->nruns, n,
+                                         ties_method, NULL));
+    s_ranks = fr_rank_na_(s_ranks, ix->indx, n, nn, na_last);
+    UNPROTECT(1);
+    return s_ranks;
+}
+
+
+
+/* Write a rank index to a file, which fastrank_index_load_ can map */
+SEXP fastrank_index_save_(SEXP s_ix, SEXP s_file) {
+
+    fr_index *ix = fr_index_get_(s_ix);
+    if (TYPEOF(s_file) != STRSXP || LENGTH(s_file) != 1)
+        error("'file' must be a single file name");
+    const char *file = CHAR(STRING_ELT(s_file, 0));
+
+    FILE *fp = fopen(file, "wb");
+    if (fp == NULL)
+        error("unable to open '%s' for writing", file);
+    size_t written = fwrite(ix->hdr, 1, ix->size, fp);
+    if (fclose(fp) != 0 || written != ix->size)
+        error("error writing rank index to '%s'", file);
+
+    return s_file;
+}
+
+
+
+/* Open a saved rank index.  The file is mapped read-only and shared, so the
+ * pages are shared between all processes that map it */
+SEXP fastrank_index_load_(SEXP s_file) {
+
+    if (TYPEOF(s_file) != STRSXP || LENGTH(s_file) != 1)
+        error("'file' must be a single file name");
+    const char *file = CHAR(STRING_ELT(s_file, 0));
+
+    fr_index *ix;
+    SEXP s_ix = PROTECT(fr_index_wrap_(&ix));
+
+#ifndef _WIN32
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        error("unable to open '%s'", file);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(fr_index_header)) {
+        close(fd);
+        error("'%s' is not a fastrank index", file);
+    }
+    size_t size = (size_t) st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        error("unable to map '%s'", file);
+    ix->hdr = (fr_index_header *) map;
+    ix->size = size;
+    ix->mapped = 1;
+#else
+    /* no mmap, read the block into memory */
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL)
+        error("unable to open '%s'", file);
+    FR_FSEEK(fp, 0, SEEK_END);
+    FR_OFF_T file_size = FR_FTELL(fp);
+    FR_FSEEK(fp, 0, SEEK_SET);
+    if (file_size < (FR_OFF_T) sizeof(fr_index_header)) {
+        fclose(fp);
+        error("'%s' is not a fastrank index", file);
+    }
+    size_t size = (size_t) file_size;
+    ix->hdr = (fr_index_header *) malloc(size);
+    if (ix->hdr == NULL) {
+        fclose(fp);
+        error("unable to allocate rank index");
+    }
+    ix->size = size;
+    size_t nread = fread(ix->hdr, 1, size, fp);
+    fclose(fp);
+    if (nread != size)
+        error("error reading rank index from '%s'", file);
+#endif
+
+    /* on error, the finalizer releases the block */
+    fr_index_check_header_(ix->hdr, size);
+    fr_index_layout_(ix);
+    fr_index_check_block_(ix);
+
+    UNPROTECT(1);
+    return s_ix;
+}
+
+
+
+/* OUT-OF-CORE RANKING ******************************************
+ *
+ * Ranks a column of doubles or 32-bit integers in a flat binary file in
+ * native byte order, which may be larger than memory, by external merge
+ * sort.  Chunks of the file are sorted in memory with the sort kernels and
+ * written as runs of (value, position) records in a temporary file each,
+ * with the positions of NAs written to a temporary file of their own.  The
+ * runs are then merged with a heap, at most FR_EXT_FANIN at a time so the
+ * number of open files stays bounded: while there are more runs than that,
+ * groups of them are merged into longer runs in passes.  In the last merge
+ * each run of tied values is ranked as it comes off the heap and its ranks
+ * are written to a memory map of the output file, a flat binary file of
+ * doubles.  Ties come off the merge in position order, so "first" needs no
+ * further work.
+ */
+
+#define FR_EXT_BUFSIZE  4096  /* records buffered from each run while merging */
+#define FR_EXT_FANIN    64    /* runs merged at once */
+
+typedef struct {
+    double  v;
+    int64_t pos;
+} fr_ext_rec;
+
+typedef struct {
+    FILE       *fp;
+    char       *name;
+    fr_ext_rec *buf;
+    size_t      len;    /* records in buf */
+    size_t      at;     /* next record in buf */
+} fr_ext_run;
+
+/* everything that must be released on success or failure */
+typedef struct {
+    FILE       *in;
+    FILE       *na;
+    char       *na_name;
+    fr_ext_run *runs;
+    int         nruns;
+    fr_ext_run  merged;  /* the run being written by a merge pass */
+    double     *out;
+    size_t      out_size;
+#ifdef _WIN32
+    FILE       *out_fp;
+#endif
+    MY_SIZE_T  *group;
+} fr_ext_state;
+
+/* close, remove and free a run */
+static void fr_ext_run_release_(fr_ext_run *run) {
+    if (run->fp) fclose(run->fp);
+    if (run->name) {
+        remove(run->name);
+        R_free_tmpnam(run->name);
+    }
+    free(run->buf);
+    memset(run, 0, sizeof(*run));
+}
+
+static void fr_ext_release_(fr_ext_state *st) {
+    if (st->in) fclose(st->in);
+    if (st->na) fclose(st->na);
+    if (st->na_name) {
+        remove(st->na_name);
+        R_free_tmpnam(st->na_name);
+    }
+    for (int r = 0; r < st->nruns; ++r)
+        fr_ext_run_release_(&st->runs[r]);
+    free(st->runs);
+    fr_ext_run_release_(&st->merged);
+#ifndef _WIN32
+    if (st->out) munmap(st->out, st->out_size);
+#else
+    if (st->out_fp) fclose(st->out_fp);
+#endif
+    free(st->group);
+    memset(st, 0, sizeof(*st));
+}
+
+#define FR_EXT_FAIL(...) { fr_ext_release_(&st); error(__VA_ARGS__); }
+
+static int fr_ext_less_(const fr_ext_rec *a, const fr_ext_rec *b) {
+    return a->v < b->v || (a->v == b->v && a->pos < b->pos);
+}
+
+/* the current record of run r, refilling its buffer if needed; returns NULL
+ * when the run is exhausted */
+static fr_ext_rec * fr_ext_head_(fr_ext_run *run) {
+    if (run->at == run->len) {
+        run->len = fread(run->buf, sizeof(fr_ext_rec), FR_EXT_BUFSIZE, run->fp);
+        run->at = 0;
+        if (run->len == 0)
+            return NULL;
+    }
+    return &run->buf[run->at];
+}
+
+/* restore the heap of run numbers h[0..nh-1] below position k */
+static void fr_ext_sift_(int h[], const int nh, int k, fr_ext_run runs[]) {
+    for (;;) {
+        int c = 2 * k + 1;
+        if (c >= nh) break;
+        if (c + 1 < nh && fr_ext_less_(&runs[h[c + 1]].buf[runs[h[c + 1]].at],
+                                       &runs[h[c]].buf[runs[h[c]].at]))
+            ++c;
+        if (! fr_ext_less_(&runs[h[c]].buf[runs[h[c]].at],
+                           &runs[h[k]].buf[runs[h[k]].at]))
+            break;
+        SWAP(int, h[k], h[c]);
+        k = c;
+    }
+}
+
+/* Open the nr runs[] for merging and build the heap h[] of those not
+ * empty, returning its size, or -1 if a run cannot be opened or buffered */
+static int fr_ext_open_(fr_ext_run runs[], const int nr, int h[]) {
+    int nh = 0;
+    for (int r = 0; r < nr; ++r) {
+        runs[r].fp = fopen(runs[r].name, "rb");
+        runs[r].buf = (fr_ext_rec *) malloc(FR_EXT_BUFSIZE * sizeof(fr_ext_rec));
+        if (! runs[r].fp || ! runs[r].buf)
+            return -1;
+        runs[r].len = runs[r].at = 0;
+        if (fr_ext_head_(&runs[r]))
+            h[nh++] = r;
+    }
+    for (int k = nh / 2 - 1; k >= 0; --k)
+        fr_ext_sift_(h, nh, k, runs);
+    return nh;
+}
+
+/* move past the record at the top of the heap h[0..*nh-1] */
+static void fr_ext_pop_(int h[], int *nh, fr_ext_run runs[]) {
+    ++runs[h[0]].at;
+    if (! fr_ext_head_(&runs[h[0]]))
+        h[0] = h[--*nh];
+    fr_ext_sift_(h, *nh, 0, runs);
+}
+
+static void fr_ext_put_(fr_ext_state *st, const MY_SIZE_T pos, const double r) {
+#ifndef _WIN32
+    st->out[pos] = r;
+#else
+    FR_FSEEK(st->out_fp, (FR_OFF_T) pos * sizeof(double), SEEK_SET);
+    fwrite(&r, sizeof(double), 1, st->out_fp);
+#endif
+}
+
+/* Rank the file s_in of values of type s_type, "double" or "integer", into
+ * the file s_out of doubles.  Chunks of s_chunk values are sorted in memory
+ * and the runs are written to s_tmpdir.  Returns the number of values */
+SEXP fastrank_file_(SEXP s_in, SEXP s_out, SEXP s_type, SEXP s_tm,
+                    SEXP s_na, SEXP s_chunk, SEXP s_sort, SEXP s_tmpdir) {
+
+    const char *in_file = CHAR(STRING_ELT(s_in, 0));
+    const char *out_file = CHAR(STRING_ELT(s_out, 0));
+    const char *tmpdir = CHAR(STRING_ELT(s_tmpdir, 0));
+    int is_double = strcmp(CHAR(STRING_ELT(s_type, 0)), "double") == 0;
+    if (! is_double && strcmp(CHAR(STRING_ELT(s_type, 0)), "integer") != 0)
+        error("'type' must be \"double\" or \"integer\"");
+    fr_ties_t ties_method = fr_ties_method_(s_tm);
+    fr_na_t na_last = fr_na_last_(s_na);
+    if (na_last == NA_LAST_NA)
+        error("'na.last' = NA is not supported for ranking files");
+    double dchunk = asReal(s_chunk);
+    if (ISNAN(dchunk) || dchunk < 1 || dchunk > (double) R_XLEN_T_MAX)
+        error("'chunk.size' must be a positive number of values");
+    MY_SIZE_T chunk = (MY_SIZE_T) dchunk;
+    /* checked here rather than by the kernels, before any files are made */
+    int sort_method = fr_sort_method_(s_sort);
+    if (is_double && sort_method > 1 && sort_method < 5)
+        error("'sort.method' must be 1, 5, 6 or 7 for type \"double\"");
+    size_t elsize = is_double ? sizeof(double) : sizeof(int);
+
+    fr_ext_state st;
+    memset(&st, 0, sizeof(st));
+
+    /* sort chunks into runs */
+    st.in = fopen(in_file, "rb");
+    if (! st.in)
+        FR_EXT_FAIL("unable to open '%s'", in_file)
+    st.na_name = R_tmpnam2("fastrank_na", tmpdir, ".bin");
+    st.na = fopen(st.na_name, "w+b");
+    if (! st.na)
+        FR_EXT_FAIL("unable to open temporary file in '%s'", tmpdir)
+
+    void *vals = R_alloc(chunk, elsize);
+    MY_SIZE_T *indx = (MY_SIZE_T *) R_alloc(chunk, sizeof(MY_SIZE_T));
+    fr_ext_rec *recs = (fr_ext_rec *) R_alloc(chunk, sizeof(fr_ext_rec));
+    MY_SIZE_T n = 0, nn = 0;
+    int maxruns = 0;
+    for (;;) {
+        MY_SIZE_T m = (MY_SIZE_T) fread(vals, elsize, chunk, st.in);
+        if (m == 0)
+            break;
+        MY_SIZE_T mm = 0;
+        for (MY_SIZE_T i = 0; i < m; ++i) {
+            int isna = is_double ? FR_ISNA_REAL(((double *) vals)[i])
+                                 : FR_ISNA_INT(((int *) vals)[i]);
+            if (isna) {
+                int64_t pos = (int64_t)(n + i);
+                if (fwrite(&pos, sizeof(pos), 1, st.na) != 1)
+                    FR_EXT_FAIL("error writing temporary file in '%s'", tmpdir)
+            } else {
+                indx[mm++] = i;
+            }
+        }
+        if (is_double)
+            fr_sort_double_((double *) vals, indx, mm, sort_method);
+        else
+            fr_sort_integer_((int *) vals, indx, mm, sort_method);
+        /* ties in position order */
+        MY_SIZE_T ib = 0;
+        for (MY_SIZE_T i = 0; i < mm; ++i) {
+            recs[i].v = is_double ? ((double *) vals)[indx[i]]
+                                  : (double) ((int *) vals)[indx[i]];
+            if (i > 0 && recs[i].v != recs[ib].v) {
+                if (i - ib > 1)
+                    qsort(indx + ib, i - ib, sizeof(MY_SIZE_T), fr_cmp_index_);
+                ib = i;
+            }
+        }
+        if (mm - ib > 1)
+            qsort(indx + ib, mm - ib, sizeof(MY_SIZE_T), fr_cmp_index_);
+        for (MY_SIZE_T i = 0; i < mm; ++i)
+            recs[i].pos = (int64_t)(n + indx[i]);
+
+        if (mm > 0) {
+            if (st.nruns == maxruns) {
+                maxruns = maxruns ? 2 * maxruns : 16;
+                fr_ext_run *runs = (fr_ext_run *) realloc(st.runs,
+                                              maxruns * sizeof(fr_ext_run));
+                if (! runs)
+                    FR_EXT_FAIL("unable to allocate memory for runs")
+                st.runs = runs;
+            }
+            fr_ext_run *run = &st.runs[st.nruns++];
+            memset(run, 0, sizeof(*run));
+            run->name = R_tmpnam2("fastrank_run", tmpdir, ".bin");
+            run->fp = fopen(run->name, "w+b");
+            if (! run->fp)
+                FR_EXT_FAIL("unable to open temporary file in '%s'", tmpdir)
+            if (fwrite(recs, sizeof(fr_ext_rec), mm, run->fp) != (size_t) mm)
+                FR_EXT_FAIL("error writing temporary file in '%s'", tmpdir)
+            int err = fclose(run->fp);
+            run->fp = NULL;
+            if (err != 0)
+                FR_EXT_FAIL("error writing temporary file in '%s'", tmpdir)
+        }
+        n += m;
+        nn += mm;
+        R_CheckUserInterrupt();
+    }
+    if (ferror(st.in))
+        FR_EXT_FAIL("error reading '%s'", in_file)
+
+    /* merge groups of runs into longer runs until FR_EXT_FANIN or fewer are
+     * left, releasing each group once it is merged */
+    int *h = (int *) R_alloc(FR_EXT_FANIN + 1, sizeof(int));
+    int nh = 0;
+    fr_ext_rec *wbuf = (fr_ext_rec *) R_alloc(FR_EXT_BUFSIZE, sizeof(fr_ext_rec));
+    while (st.nruns > FR_EXT_FANIN) {
+        int nmerged = 0;
+        for (int r0 = 0; r0 < st.nruns; r0 += FR_EXT_FANIN) {
+            int nr = (st.nruns - r0 < FR_EXT_FANIN) ? st.nruns - r0 : FR_EXT_FANIN;
+            fr_ext_run *runs = st.runs + r0;
+            st.merged.name = R_tmpnam2("fastrank_run", tmpdir, ".bin");
+            st.merged.fp = fopen(st.merged.name, "wb");
+            if (! st.merged.fp)
+                FR_EXT_FAIL("unable to open temporary file in '%s'", tmpdir)
+            if ((nh = fr_ext_open_(runs, nr, h)) < 0)
+                FR_EXT_FAIL("unable to open temporary file in '%s'", tmpdir)
+            size_t nw = 0;
+            while (nh > 0) {
+                wbuf[nw++] = runs[h[0]].buf[runs[h[0]].at];
+                fr_ext_pop_(h, &nh, runs);
+                if (nw == FR_EXT_BUFSIZE || nh == 0) {
+                    if (fwrite(wbuf, sizeof(fr_ext_rec), nw, st.merged.fp) != nw)
+                        FR_EXT_FAIL("error writing temporary file in '%s'", tmpdir)
+                    nw = 0;
+                }
+            }
+            for (int r = 0; r < nr; ++r)
+                fr_ext_run_release_(&runs[r]);
+            int err = fclose(st.merged.fp);
+            st.merged.fp = NULL;
+            if (err != 0)
+                FR_EXT_FAIL("error writing temporary file in '%s'", tmpdir)
+            st.runs[nmerged++] = st.merged;
+            memset(&st.merged, 0, sizeof(st.merged));
+            R_CheckUserInterrupt();
+        }
+        st.nruns = nmerged;
+    }
+
+    /* the output file, mapped */
+#ifndef _WIN32
+    int fd = open(out_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        FR_EXT_FAIL("unable to open '%s' for writing", out_file)
+    st.out_size = (size_t) n * sizeof(double);
+    if (ftruncate(fd, (off_t) st.out_size) != 0) {
+        close(fd);
+        FR_EXT_FAIL("unable to extend '%s'", out_file)
+    }
+    if (n > 0) {
+        void *map = mmap(NULL, st.out_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            FR_EXT_FAIL("unable to map '%s'", out_file)
+        st.out = (double *) map;
+    } else {
+        close(fd);
+    }
+#else
+    st.out_fp = fopen(out_file, "wb");
+    if (! st.out_fp)
+        FR_EXT_FAIL("unable to open '%s' for writing", out_file)
+#endif
+
+    /* merge the runs, ranking each run of ties as it is completed */
+    double offset = (na_last == NA_LAST_FALSE) ? (double)(n - nn) : 0.0;
+    if ((nh = fr_ext_open_(st.runs, st.nruns, h)) < 0)
+        FR_EXT_FAIL("unable to open temporary file in '%s'", tmpdir)
+
+    MY_SIZE_T gmax = 1024, t = 0, done = 0;
+    double gv = 0.0;
+    st.group = (MY_SIZE_T *) malloc(gmax * sizeof(MY_SIZE_T));
+    if (! st.group)
+        FR_EXT_FAIL("unable to allocate memory for ties")
+    fr_rng_t rng = { 0 };
+    if (ties_method == TIES_RANDOM) {
+        GetRNGstate();
+        fr_rng_seed_(&rng);
+        PutRNGstate();
+    }
+    for (;;) {
+        fr_ext_rec *rec = nh ? &st.runs[h[0]].buf[st.runs[h[0]].at] : NULL;
+        if (t > 0 && (! rec || rec->v != gv)) {
+            /* rank the t tied values at positions group[], ranks done+1..done+t */
+            MY_SIZE_T j;
+            switch (ties_method) {
+            case TIES_AVERAGE:
+                for (j = 0; j < t; ++j)
+                    fr_ext_put_(&st, st.group[j], offset + done + (t + 1) / 2.0);
+                break;
+            case TIES_FIRST:
+                for (j = 0; j < t; ++j)
+                    fr_ext_put_(&st, st.group[j], offset + done + j + 1);
+                break;
+            case TIES_RANDOM:
+                for (j = t - 1; j > 0; --j) {
+                    MY_SIZE_T k = fr_rng_below_(&rng, j + 1);
+                    SWAP(MY_SIZE_T, st.group[j], st.group[k]);
+                }
+                for (j = 0; j < t; ++j)
+                    fr_ext_put_(&st, st.group[j], offset + done + j + 1);
+                break;
+            case TIES_MAX:
+                for (j = 0; j < t; ++j)
+                    fr_ext_put_(&st, st.group[j], offset + done + t);
+                break;
+            case TIES_MIN:
+                for (j = 0; j < t; ++j)
+                    fr_ext_put_(&st, st.group[j], offset + done + 1);
+                break;
+            default:
+                break;
+            }
+            done += t;
+            t = 0;
+        }
+        if (! rec)
+            break;
+        if (t == gmax) {
+            gmax *= 2;
+            MY_SIZE_T *g = (MY_SIZE_T *) realloc(st.group, gmax * sizeof(MY_SIZE_T));
+            if (! g)
+                FR_EXT_FAIL("unable to allocate memory for ties")
+            st.group = g;
+        }
+        gv = rec->v;
+        st.group[t++] = (MY_SIZE_T) rec->pos;
+        fr_ext_pop_(h, &nh, st.runs);
+        if ((done + t) % 1048576 == 0)
+            R_CheckUserInterrupt();
+    }
+
+    /* NAs in order of position */
+    rewind(st.na);
+    int64_t pos;
+    for (MY_SIZE_T j = 0; fread(&pos, sizeof(pos), 1, st.na) == 1; ++j) {
+        double r;
+        switch (na_last) {
+        case NA_LAST_TRUE:  r = (double)(nn + j + 1); break;
+        case NA_LAST_FALSE: r = (double)(j + 1); break;
+        default:            r = NA_REAL; break;
+        }
+        fr_ext_put_(&st, (MY_SIZE_T) pos, r);
+    }
+
+#ifndef _WIN32
+    if (st.out && msync(st.out, st.out_size, MS_SYNC) != 0)
+        FR_EXT_FAIL("error writing '%s'", out_file)
+#else
+    if (fflush(st.out_fp) != 0)
+        FR_EXT_FAIL("error writing '%s'", out_file)
+#endif
+    fr_ext_release_(&st);
+
+    return ScalarReal((double) n);
+}
+
+
+
+/* C API ******************************************
+ *
+ * Ranking and sorting of plain int and double buffers, registered with
+ * R_RegisterCCallable for the C code of other packages, which call them
+ * through the wrappers in inst/include/fastrank.h.  The caller provides the
+ * ranks and the index as scratch, so nothing is allocated for a call.  The
+ * values must not be NA or NaN.  They return 0, or -1 if
+ * ties_method or sort_method is unknown, rather than raising an error from
+ * the middle of the caller's loop.  Ties broken with "first" are broken by
+ * position, and "random" takes its seed from unif_rand(), so the caller must
+ * bracket its calls with GetRNGstate() and PutRNGstate().
+ */
+
+#define FR_api_rank(__SORT) \
+    { \
+    if (ties_method < TIES_AVERAGE || ties_method > TIES_MIN \
+        || __SORT(col, n, sort_method, indx) != 0) \
+        return -1; \
+    const MY_SIZE_T nn = n; \
+    fr_tie_stats *tstats = NULL; \
+    switch (ties_method) { \
+    case TIES_AVERAGE: \
+        FR_rank_walk(FR_ties_average, TYPE, FR_COLUMN, double, n) \
+        break; \
+    case TIES_FIRST: \
+        FR_stable_runs(TYPE, FR_COLUMN) \
+        FR_rank_walk(FR_ties_first, TYPE, FR_COLUMN, double, n) \
+        break; \
+    case TIES_RANDOM: { \
+        fr_rng_t rng; \
+        fr_rng_seed_(&rng); \
+        FR_rank_walk(FR_ties_random, TYPE, FR_COLUMN, double, n) \
+        break; \
+    } \
+    case TIES_MAX: \
+        FR_rank_walk(FR_ties_max, TYPE, FR_COLUMN, double, n) \
+        break; \
+    case TIES_MIN: \
+        FR_rank_walk(FR_ties_min, TYPE, FR_COLUMN, double, n) \
+        break; \
+    } \
+    return 0; \
+    }
+
+/* Fill indx[0..n-1] with the positions of col[0..n-1] in sorted order,
+ * 0-based */
+static int fr_api_sort_int_(const int * col, const MY_SIZE_T n,
+                            const int sort_method, MY_SIZE_T indx[]) {
+    if (sort_method < 1 || sort_method > 7)
+        return -1;
+    for (MY_SIZE_T i = 0; i < n; ++i)
+        indx[i] = i;
+    fr_sort_integer_(col, indx, n, sort_method);
+    return 0;
+}
+
+static int fr_api_sort_double_(const double * col, const MY_SIZE_T n,
+                               const int sort_method, MY_SIZE_T indx[]) {
+    if (sort_method != 1 && (sort_method < 5 || sort_method > 7))
+        return -1;
+    for (MY_SIZE_T i = 0; i < n; ++i)
+        indx[i] = i;
+    fr_sort_double_(col, indx, n, sort_method);
+    return 0;
+}
+
+/* Rank col[0..n-1] into ranks[], with indx[0..n-1] as scratch */
+static int fr_api_rank_int_(const int * col, const MY_SIZE_T n,
+                            const int ties_method, const int sort_method,
+                            double ranks[], MY_SIZE_T indx[]) {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE int
+    FR_api_rank(fr_api_sort_int_)
+#undef EQUAL
+#undef TYPE
+}
+
+static int fr_api_rank_double_(const double * col, const MY_SIZE_T n,
+                               const int ties_method, const int sort_method,
+                               double ranks[], MY_SIZE_T indx[]) {
+#define EQUAL(_x, _y) (_x == _y)
+#define TYPE double
+    FR_api_rank(fr_api_sort_double_)
+#undef EQUAL
+#undef TYPE
+}
@@ -0,0 +1,657 @@
+/* fastrank_sort.h: the sort kernels of fastrank, which sort an index
+ * vector indx[] by the values a[indx[i]] without moving the values, and the
+ * rank walk that assigns ranks from the sorted index.  They use nothing from
+ * R, so they are shared by the R package and by the command-line tool in
+ * src/cli.  Define MY_SIZE_T for the type of indices and FR_SORT_ERROR(msg)
+ * for reporting an unknown sort method before including this, or take the
+ * defaults below.
+ */
+
+#ifndef FASTRANK_SORT_H
+#define FASTRANK_SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef MY_SIZE_T
+#  define MY_SIZE_T ptrdiff_t
+#endif
+
+#ifndef FR_SORT_ERROR
+#  include <stdio.h>
+#  include <stdlib.h>
+#  define FR_SORT_ERROR(_msg) { fprintf(stderr, "%s\n", _msg); exit(1); }
+#endif
+
+/* compile with -DFR_INSTRUMENT=1 to count comparisons, swaps, insertion
+ * sorts and the depth of recursion in fr_sort_counters */
+#ifndef FR_INSTRUMENT
+#  define FR_INSTRUMENT 0
+#endif
+
+#if FR_INSTRUMENT
+typedef struct {
+    double comparisons;
+    double swaps;
+    double insertion_sorts;
+    int    depth;
+    int    max_depth;
+} fr_sort_counters_t;
+static fr_sort_counters_t fr_sort_counters;
+#  define FR_COUNT(_f) (++fr_sort_counters._f)
+#  define FR_ENTER { \
+        if (++fr_sort_counters.depth > fr_sort_counters.max_depth) \
+            fr_sort_counters.max_depth = fr_sort_counters.depth; }
+#  define FR_LEAVE (--fr_sort_counters.depth)
+#else
+#  define FR_COUNT(_f) ((void) 0)
+#  define FR_ENTER
+#  define FR_LEAVE ((void) 0)
+#endif
+
+/* at what length does quicksort switch to insertion sort? */
+#define QUICKSORT_INSERTION_CUTOFF       20
+#define QUICKSORT3WAY_INSERTION_CUTOFF   20
+
+
+/* SORTING *********************************
+ *
+ * See also BENCHMARKING.md, which I'll create after I've completed all the
+ * benchmarking I intend to do.
+ *
+ * Quicksort from http://rosettacode.org/wiki/Sorting_algorithms/Quicksort
+ * and especially Wikipedia modified two ways:
+ *
+ * 1. Return a vector of indices and not modify the array of values a[],
+ * which requires that the indx[] vector is pre-allocated and filled 0..n-1
+ *
+ * 2. Use insertion sort for vectors length <= QUICKSORT_INSERTION_CUTOFF
+ *
+ * Note the papers and resources (esp Sedgwick) I have collected, the LESSER
+ * loops should probably be changed to <= to avoid pathological behaviour.
+ * Also if a[indx[i]] == a[indx[j]] then they should only be swapped if 
+ * j < i.  That might be enough to make it stable...
+ *
+ * Also note the Dual Pivot Quicksort papers, that might be the truly
+ * best way to go.
+ *
+ * The pivot is the median of the values a quarter, a half and three
+ * quarters of the way along, which the 3-way quicksorts then move to the
+ * end, so sorted, reversed and organ-pipe vectors are not quadratic.
+ * Every quicksort recurses only into the smaller part and loops on the
+ * larger, so the stack is never more than about log2(n) calls deep whatever
+ * the input.
+ */
+
+/* Move the median of the values at n / 4, n / 2 and n - 1 - n / 4 to
+ * indx[n / 2] */
+#define FR_median3(__LESSER) \
+    { \
+    MY_SIZE_T lo = n / 4, mid = n / 2, hi = n - 1 - n / 4; \
+    if (__LESSER(a[indx[mid]], a[indx[lo]])) { \
+        SWAP(MY_SIZE_T, indx[mid], indx[lo]); \
+    } \
+    if (__LESSER(a[indx[hi]], a[indx[mid]])) { \
+        SWAP(MY_SIZE_T, indx[hi], indx[mid]); \
+        if (__LESSER(a[indx[mid]], a[indx[lo]])) { \
+            SWAP(MY_SIZE_T, indx[mid], indx[lo]); \
+        } \
+    } \
+    }
+
+static void
+fr_quicksort3way_integer_i_(const int *     a, 
+                            MY_SIZE_T       indx[],
+                            MY_SIZE_T       n,
+                            const MY_SIZE_T crit_size) {
+
+#undef EQUAL
+#undef LESSER
+#undef SWAP
+#define EQUAL(__A, __B) (FR_COUNT(comparisons), __A == __B)
+#define LESSER(__A, __B) (FR_COUNT(comparisons), __A < __B)
+#define SWAP(__T, __A, __B) { FR_COUNT(swaps); __T t = __A; __A = __B; __B = t; }
+    MY_SIZE_T i, j, p, q, k;
+    FR_ENTER
+
+    for (;;) {
+    //if (n <= 1) return; 
+    //if (n <= QUICKSORT_INSERTION_CUTOFF) {
+    if (n <= crit_size) {
+        FR_COUNT(insertion_sorts);
+        for (i = 1; i < n; ++i) {
+            MY_SIZE_T it = indx[i];
+            for (j = i; j > 0 && LESSER(a[it], a[indx[j - 1]]); --j) {
+                indx[j] = indx[j - 1];
+            }
+            indx[j] = it;
+        }
+        FR_LEAVE;
+        return;
+    }
+
+    FR_median3(LESSER);
+    SWAP(MY_SIZE_T, indx[n / 2], indx[n - 1]);
+    int pvt = a[indx[n - 1]];
+
+    for (i = 0; LESSER(a[indx[i]], pvt); ++i);
+    for (j = n - 2; LESSER(pvt, a[indx[j]]) && j > 0; --j);
+    p = 0;
+    q = n - 1;
+    if (i < j) {
+        SWAP(MY_SIZE_T, indx[i], indx[j]);
+        if (EQUAL(a[indx[i]], pvt))
+            SWAP(MY_SIZE_T, indx[p], indx[i]);
+        if (EQUAL(a[indx[j]], pvt)) {
+            q--;
+            SWAP(MY_SIZE_T, indx[q], indx[j]);
+        }
+        for (;;) {
+            while (++i, LESSER(a[indx[i]], pvt)) ;  
+            while (--j, LESSER(pvt, a[indx[j]]))
+                if (j == 0) break; 
+            if (i >= j) break;
+            SWAP(MY_SIZE_T, indx[i], indx[j]);
+            if (EQUAL(a[indx[i]], pvt)) { 
+                if (p) p++; 
+                SWAP(MY_SIZE_T, indx[p], indx[i]);
+            } 
+            if (EQUAL(a[indx[j]], pvt)) {
+                q--;
+                SWAP(MY_SIZE_T, indx[q], indx[j]);
+            }
+        }
+    }
+    SWAP(MY_SIZE_T, indx[i], indx[n - 1]); 
+    j = i - 1;
+    i++;
+    for (k = 0; k < p; k++, j--)
+        SWAP(MY_SIZE_T, indx[k], indx[j]); 
+    for (k = n - 2; k > q; k--, i++)
+        SWAP(MY_SIZE_T, indx[i], indx[k]);
+    //
+    //printf("n=%2ld  a[0..%2ld]: ", n, n - 1);
+    //for (int t = 0; t < n; ++t) printf("[%2d] %2d  ", t, a[t]);
+    //printf("\n");
+    //
+    if (j + 1 < n - i) {
+        fr_quicksort3way_integer_i_(a, indx, j + 1, crit_size);
+        indx += i;
+        n -= i;
+    } else {
+        fr_quicksort3way_integer_i_(a, indx + i, n - i, crit_size);
+        n = j + 1;
+    }
+    }
+}
+
+
+#undef __TYPE
+#undef __LESSER
+#undef __EQUAL
+#undef __CRIT_SIZE
+#undef SWAP
+#define SWAP(__T, __A, __B) { FR_COUNT(swaps); __T t = __A; __A = __B; __B = t; }
+
+#define FR_quicksort3way_body(__TYPE, __LESSER, __EQUAL, __CRIT_SIZE) \
+    MY_SIZE_T i, j, p, q, k; \
+    { \
+    if (n <= crit_size) { \
+        FR_COUNT(insertion_sorts); \
+        for (i = 1; i < n; ++i) { \
+            MY_SIZE_T it = indx[i]; \
+            for (j = i; j > 0 && __LESSER(a[it], a[indx[j - 1]]); --j) { \
+                indx[j] = indx[j - 1]; \
+            } \
+            indx[j] = it; \
+        } \
+        FR_LEAVE; \
+        return; \
+    } \
+    FR_median3(__LESSER); \
+    SWAP(MY_SIZE_T, indx[n / 2], indx[n - 1]); \
+    __TYPE pvt = a[indx[n - 1]]; \
+    for (i = 0; __LESSER(a[indx[i]], pvt); ++i); \
+    for (j = n - 2; __LESSER(pvt, a[indx[j]]) && j > 0; --j); \
+    p = 0; \
+    q = n - 1; \
+    if (i < j) { \
+        SWAP(MY_SIZE_T, indx[i], indx[j]); \
+        if (__EQUAL(a[indx[i]], pvt)) {  \
+            SWAP(MY_SIZE_T, indx[p], indx[i]); \
+        }  \
+        if (__EQUAL(a[indx[j]], pvt)) { \
+            q--; \
+            SWAP(MY_SIZE_T, indx[q], indx[j]); \
+        } \
+        for (;;) { \
+            while (++i, __LESSER(a[indx[i]], pvt)) ;   \
+            while (--j, __LESSER(pvt, a[indx[j]])) {   \
+                if (j == 0) break;  \
+            } \
+            if (i >= j) break; \
+            SWAP(MY_SIZE_T, indx[i], indx[j]); \
+            if (__EQUAL(a[indx[i]], pvt)) {  \
+                if (p) p++;  \
+                SWAP(MY_SIZE_T, indx[p], indx[i]); \
+            }  \
+            if (__EQUAL(a[indx[j]], pvt)) { \
+                q--; \
+                SWAP(MY_SIZE_T, indx[q], indx[j]); \
+            } \
+        } \
+    } \
+    SWAP(MY_SIZE_T, indx[i], indx[n - 1]);  \
+    j = i - 1; \
+    i++; \
+    for (k = 0; k < p; k++, j--) { \
+        SWAP(MY_SIZE_T, indx[k], indx[j]);  \
+    } \
+    for (k = n - 2; k > q; k--, i++) { \
+        SWAP(MY_SIZE_T, indx[i], indx[k]); \
+    } \
+    }
+
+
+#undef LESSER
+#undef EQUAL
+#define LESSER(__A, __B) (FR_COUNT(comparisons), __A < __B)
+#define EQUAL(__A, __B) (FR_COUNT(comparisons), __A == __B)
+static void
+fr_quicksort3way_integer2_i_(const int *     a, 
+                            MY_SIZE_T       indx[],
+                            MY_SIZE_T       n,
+                            const MY_SIZE_T crit_size) {
+
+    FR_ENTER
+    for (;;) {
+        FR_quicksort3way_body(int, LESSER, EQUAL, crit_size);
+
+        if (j + 1 < n - i) {
+            fr_quicksort3way_integer2_i_(a, indx, j + 1, crit_size);
+            indx += i;
+            n -= i;
+        } else {
+            fr_quicksort3way_integer2_i_(a, indx + i, n - i, crit_size);
+            n = j + 1;
+        }
+    }
+}
+
+#undef LESSER
+#undef EQUAL
+#define LESSER(__A, __B) (FR_COUNT(comparisons), __A < __B)
+#define EQUAL(__A, __B) (FR_COUNT(comparisons), __A == __B)
+static void
+fr_quicksort3way_double2_i_(const double *     a, 
+                            MY_SIZE_T       indx[],
+                            MY_SIZE_T       n,
+                            const MY_SIZE_T crit_size) {
+
+    FR_ENTER
+    for (;;) {
+        FR_quicksort3way_body(double, LESSER, EQUAL, crit_size);
+
+        if (j + 1 < n - i) {
+            fr_quicksort3way_double2_i_(a, indx, j + 1, crit_size);
+            indx += i;
+            n -= i;
+        } else {
+            fr_quicksort3way_double2_i_(a, indx + i, n - i, crit_size);
+            n = j + 1;
+        }
+    }
+}
+
+
+
+
+#undef __TYPE
+#undef __LESSER
+#define FR_quicksort_body(__TYPE, __LESSER) \
+    MY_SIZE_T i; /* used as param outside of body */ \
+    { \
+    __TYPE pvt; \
+    MY_SIZE_T j, it; \
+    if (n <= QUICKSORT_INSERTION_CUTOFF) { \
+        FR_COUNT(insertion_sorts); \
+        for (i = 1; i < n; ++i) { \
+            it = indx[i]; \
+            for (j = i; j > 0 && __LESSER(a[it], a[indx[j - 1]]); --j) { \
+                indx[j] = indx[j - 1]; \
+            } \
+            indx[j] = it; \
+        } \
+        FR_LEAVE; \
+        return; \
+    } \
+    FR_median3(__LESSER); \
+    pvt = a[indx[n / 2]]; \
+    for (i = 0, j = n - 1; ; i++, j--) { \
+        while (__LESSER(a[indx[i]], pvt)) i++; \
+        while (__LESSER(pvt, a[indx[j]])) j--; \
+        if (i >= j) break; \
+        SWAP(MY_SIZE_T, indx[i], indx[j]); \
+    } \
+    }
+
+
+#undef LESSER
+#undef EQUAL
+#define LESSER(__A, __B) (FR_COUNT(comparisons), __A < __B)
+#define EQUAL(__A, __B) (FR_COUNT(comparisons), __A == __B)
+static void
+fr_quicksort_integer_i_(const int * a, 
+                        MY_SIZE_T indx[], 
+                        MY_SIZE_T n) {
+
+    FR_ENTER
+    for (;;) {
+        FR_quicksort_body(int, LESSER)
+
+        if (i < n - i) {
+            fr_quicksort_integer_i_(a, indx, i);
+            indx += i;
+            n -= i;
+        } else {
+            fr_quicksort_integer_i_(a, indx + i, n - i);
+            n = i;
+        }
+    }
+}
+
+
+
+#undef LESSER
+#undef EQUAL
+#define LESSER(__A, __B) (FR_COUNT(comparisons), __A < __B)
+#define EQUAL(__A, __B) (FR_COUNT(comparisons), __A == __B)
+static void
+fr_quicksort_double_i_ (const double * a, 
+                        MY_SIZE_T indx[], 
+                        MY_SIZE_T n) {
+
+    FR_ENTER
+    for (;;) {
+        FR_quicksort_body(double, LESSER)
+
+        if (i < n - i) {
+            fr_quicksort_double_i_(a, indx, i);
+            indx += i;
+            n -= i;
+        } else {
+            fr_quicksort_double_i_(a, indx + i, n - i);
+            n = i;
+        }
+    }
+}
+
+
+
+/* Sort indx[] by the integers a[indx[i]] with the routine chosen by
+ * sort_method, 1 to 7 */
+static void fr_sort_integer_(const int * a, MY_SIZE_T indx[],
+                             const MY_SIZE_T n, const int sort_method) {
+    switch(sort_method) {
+    case 1:
+        fr_quicksort_integer_i_(a, indx, n);
+        break;
+    case 2:
+        fr_quicksort3way_integer_i_(a, indx, n, 1);
+        break;
+    case 3:
+        fr_quicksort3way_integer_i_(a, indx, n, 10);
+        break;
+    case 4:
+        fr_quicksort3way_integer_i_(a, indx, n, 20);
+        break;
+    case 5:
+        fr_quicksort3way_integer2_i_(a, indx, n, 1);
+        break;
+    case 6:
+        fr_quicksort3way_integer2_i_(a, indx, n, 10);
+        break;
+    case 7:
+        fr_quicksort3way_integer2_i_(a, indx, n, 20);
+        break;
+    default:
+        FR_SORT_ERROR("unknown sort_method for INTSXP and LGLSXP");
+        break;
+    }
+}
+
+/* Sort indx[] by the doubles a[indx[i]], which must not be NaN, with the
+ * routine chosen by sort_method, 1 or 5 to 7 */
+static void fr_sort_double_(const double * a, MY_SIZE_T indx[],
+                            const MY_SIZE_T n, const int sort_method) {
+    switch(sort_method) {
+    case 1:
+        fr_quicksort_double_i_(a, indx, n);
+        break;
+    case 5:
+        fr_quicksort3way_double2_i_(a, indx, n, 1);
+        break;
+    case 6:
+        fr_quicksort3way_double2_i_(a, indx, n, 10);
+        break;
+    case 7:
+        fr_quicksort3way_double2_i_(a, indx, n, 20);
+        break;
+    default:
+        FR_SORT_ERROR("unknown sort_method for REALSXP");
+        break;
+    }
+}
+
+/* SWAP outside the kernels is not counted */
+#undef SWAP
+#define SWAP(__T, __A, __B) { __T t = __A; __A = __B; __B = t; }
+
+
+
+/* RANK WALK *********************************
+ *
+ * Ranks are assigned by walking the sorted index and resolving each run of
+ * tied values with one of the FR_ties_* methods, by the same macros in the
+ * R package and the command-line tool, so the two rank alike.  The caller
+ * defines EQUAL(a, b) for the values being ranked, and has indx[], ranks[]
+ * (for the FR_TO_RANKS and FR_TO_SORTED targets), tstats (a pointer to
+ * fr_tie_stats or NULL) and, for FR_ties_random, an fr_rng_t rng in scope.
+ * __TCONV(s_x) gives the values; callers without an s_x define __TCONV to
+ * ignore it.  Define FR_TRACE(...) to print a trace of the walk.
+ */
+
+#ifndef FR_TRACE
+#  define FR_TRACE(...) ((void) 0)
+#endif
+
+/* statistics of the runs of tied values, collected while ranking if
+ * requested: the number of runs of more than one value, their sizes in rank
+ * order, and the sum of t^3 - t over their sizes t, used in tie corrections */
+typedef struct {
+    MY_SIZE_T  ngroups;
+    MY_SIZE_T *sizes;
+    double     sum3;
+} fr_tie_stats;
+
+
+/* Ranks are written to a target __TO, the prefix of two macros taking the
+ * position _j_ in sorted order of the value ranked: __TO##_AT(_j_) is an
+ * lvalue for its rank, and __TO##_STORE(_j_, _r_) stores rank _r_ for it.
+ * FR_TO_RANKS writes to ranks[] by original position, and FR_TO_SORTED
+ * writes to ranks[] in sorted order, for the blocked scatter below */
+#define FR_TO_RANKS_AT(_j_)          ranks[indx[_j_]]
+#define FR_TO_RANKS_STORE(_j_, _r_)  FR_TO_RANKS_AT(_j_) = (_r_)
+#define FR_TO_SORTED_AT(_j_)         ranks[_j_]
+#define FR_TO_SORTED_STORE(_j_, _r_) FR_TO_SORTED_AT(_j_) = (_r_)
+
+/* ties' rank is the minimum of their ranks */
+#define FR_ties_min(__RTYPE, __TO, __loc__) \
+    { \
+    __RTYPE rnk = (__RTYPE)(ib + 1); \
+    FR_TRACE("min, ranks[%d .. %d] <- %d   " __loc__ "\n", \
+                       indx[ib], indx[i - 1], rnk); \
+    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
+        __TO##_STORE(j, rnk); \
+    } \
+    }
+
+/* ties' rank is the maximum of their ranks */
+#define FR_ties_max(__RTYPE, __TO, __loc__) \
+    { \
+    __RTYPE rnk = (__RTYPE)i; \
+    FR_TRACE("max, ranks[%d .. %d] <- %d   " __loc__ "\n", \
+                       indx[ib], indx[i - 1], rnk); \
+    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
+        __TO##_STORE(j, rnk); \
+    } \
+    }
+
+/* ties' rank is the average of their ranks */
+#define FR_ties_average(__RTYPE, __TO, __loc__) \
+    { \
+    __RTYPE rnk = (i - 1 + ib + 2) / 2.0; \
+    FR_TRACE("average, ranks[%d .. %d] <- %d   " __loc__ "\n", \
+                       indx[ib], indx[i - 1], rnk); \
+    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
+        __TO##_STORE(j, rnk); \
+    } \
+    }
+
+/* ties' rank is consecutive on their order */
+#define FR_ties_first(__RTYPE, __TO, __loc__) \
+    { \
+    FR_TRACE("is 'first' only correct when sort is stable?"); \
+    for (MY_SIZE_T j = ib; j <= i - 1; ++j) { \
+        __RTYPE rnk = (__RTYPE)(j + 1); \
+        FR_TRACE("first, ranks[%d] <- %d  " __loc__ "\n", indx[j], rnk); \
+        __TO##_STORE(j, rnk); \
+    } \
+    }
+
+/* Ties broken at random are shuffled with splitmix64, a counter-based
+ * generator: each draw is a hash of the counter after adding a constant, so
+ * one 64-bit seed makes the ranks reproducible, and the generator is a
+ * plain local variable that parallel rank-assignment threads can each hold,
+ * seeded from one seed with their thread number added.  The R package seeds
+ * it from R's RNG stream so set.seed() applies, and the command-line tool
+ * from its -s option */
+typedef struct {
+    uint64_t ctr;
+} fr_rng_t;
+
+static inline uint64_t fr_rng_next_(fr_rng_t * rng) {
+    uint64_t z = (rng->ctr += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform on 0 .. k-1, from the top 53 bits of a draw */
+static inline MY_SIZE_T fr_rng_below_(fr_rng_t * rng, const MY_SIZE_T k) {
+    return (MY_SIZE_T)((double)(fr_rng_next_(rng) >> 11)
+                       * (1.0 / 9007199254740992.0) * k);
+}
+
+/* ties' rank is a random shuffling of their order: store their ranks as for
+ * "first", then shuffle them in place among the tied positions with rng.
+ * Nothing is allocated, but __TO must have an _AT lvalue */
+#define FR_ties_random(__RTYPE, __TO, __loc__) \
+    { \
+    MY_SIZE_T j; \
+    for (j = ib; j <= i - 1; ++j) \
+        __TO##_STORE(j, (__RTYPE)(j + 1)); \
+    for (j = i - 1; j > ib; --j) { \
+        MY_SIZE_T k = ib + fr_rng_below_(&rng, j - ib + 1); \
+        SWAP(__RTYPE, __TO##_AT(j), __TO##_AT(k)); \
+    } \
+    FR_TRACE("random, ranks[%d .. %d]  " __loc__ "\n", \
+                       indx[ib], indx[i - 1]); \
+    }
+
+
+
+#define XI(_i_) x[indx[_i_]]   /* accessing the vector through the index */
+
+
+
+/* record a run of __T__ tied values if tstats is not NULL */
+#define FR_tie_stat(__T__) \
+    if (tstats) { \
+        MY_SIZE_T __t = (__T__); \
+        if (tstats->sizes) /* NULL if only sum3 is wanted */ \
+            tstats->sizes[tstats->ngroups] = __t; \
+        ++tstats->ngroups; \
+        tstats->sum3 += (double)__t * __t * __t - __t; \
+    }
+
+/* Walk the first __N entries of the sorted indx[], writing ranks of type
+ * __RTYPE to __TO and resolving runs of ties with __TIES__ */
+#define FR_rank_walk_to(__TO, __TIES__, __TYPE, __TCONV, __RTYPE, __N) \
+    if (__N > 0) { \
+    __TYPE* x = __TCONV(s_x); \
+    MY_SIZE_T ib = 0; \
+    __TYPE b = XI(0); \
+    MY_SIZE_T i; \
+    FR_TRACE("ib = %d\n", ib); \
+    for (i = 1; i < __N; ++i) { \
+        if (! EQUAL(XI(i), b)) { \
+            FR_TRACE("XI(%d) != b\n", i); \
+            if (ib < i - 1) { \
+                __TIES__(__RTYPE, __TO, "MID") \
+                FR_tie_stat(i - ib) \
+            } else { \
+                FR_TRACE("ranks[%d] <- %.1f  MID\n", indx[ib], (double)(ib + 1)); \
+                __TO##_STORE(ib, (__RTYPE)(ib + 1)); \
+            } \
+            b = XI(i); \
+            ib = i; \
+            FR_TRACE("ib = %d\n", ib); \
+        } \
+    } \
+    if (ib == i - 1) {\
+        FR_TRACE("ranks[%d] <- %.1f  FIN\n", ib, (double)(indx[ib])); \
+        __TO##_STORE(ib, (__RTYPE)(i)); \
+    } else { \
+        __TIES__(__RTYPE, __TO, "FIN") \
+        FR_tie_stat(i - ib) \
+    } \
+    }
+
+#define FR_rank_walk(__TIES__, __TYPE, __TCONV, __RTYPE, __N) \
+    FR_rank_walk_to(FR_TO_RANKS, __TIES__, __TYPE, __TCONV, __RTYPE, __N)
+
+/* Put the positions within each run of ties in the sorted indx[0..nn-1] in
+ * increasing order, so ranks for "first" follow order of appearance after
+ * an unstable sort */
+static inline int fr_cmp_index_(const void *a, const void *b) {
+    MY_SIZE_T ia = *(const MY_SIZE_T *) a, ib = *(const MY_SIZE_T *) b;
+    return (ia > ib) - (ia < ib);
+}
+
+#define FR_stable_runs(__TYPE, __TCONV) \
+    { \
+    const __TYPE* x = __TCONV(s_x); \
+    MY_SIZE_T ib = 0; \
+    for (MY_SIZE_T i = 1; i <= nn; ++i) { \
+        if (i == nn || ! EQUAL(XI(i), XI(ib))) { \
+            if (i - ib > 1) \
+                qsort(indx + ib, i - ib, sizeof(MY_SIZE_T), fr_cmp_index_); \
+            ib = i; \
+        } \
+    } \
+    }
+
+/* Partition positions 0..n-1 into non-NA values at indx[0..lo-1] in order
+ * and NAs at indx[hi..n-1] in reverse order, from lo = 0 and hi = n */
+#define FR_partition_na(__TYPE, __TCONV, __ISNA) \
+    { \
+    const __TYPE* x = __TCONV(s_x); \
+    for (MY_SIZE_T i = 0; i < n; ++i) { \
+        if (__ISNA(x[i])) indx[--hi] = i; \
+        else indx[lo++] = i; \
+    } \
+    }
+
+#endif /* FASTRANK_SORT_H */
@@ -0,0 +1,375 @@
+/* benchmark: time the sort kernels of fastrank without R
+ *
+ * Times each sort engine in ../fastrank_sort.h, the sort methods 1 to 7 for
+ * integers and 1, 5, 6 and 7 for doubles, over the grid of vector lengths
+ * and sample fractions of benchmarking.R and over five orderings of the
+ * values: random, sorted, reversed, identical and organ-pipe.  Values are
+ * drawn as in benchmarking.R, sample(round(length * fraction), length,
+ * replace = fraction < 10), so smaller fractions give more duplicates.
+ * Each cell is repeated until it has taken MIN_CELL_SECONDS or MAX_REPS
+ * runs, and the minimum, median and 99th percentile of the run times are
+ * reported.  Only the sort is timed, not filling the index.
+ *
+ * Results are written as JSON to stdout, or to the file given with -o, and
+ * progress to stderr.  Some engines are quadratic on sorted input, and
+ * recurse deeply enough to overflow the stack, so each cell is timed in a
+ * child process.  A cell whose first run takes longer than the limit given
+ * with -t, or which is killed when a run takes twice that limit, is
+ * reported with
+ * "status": "timeout", and one whose child crashes with "status": "crash",
+ * and longer vectors for the same engine, ordering and fraction are then
+ * skipped.
+ *
+ *     benchmark [-q] [-o file] [-t seconds] [-s seed] [-e engine]
+ *
+ * The limit is 2 seconds unless given.  -q runs a quick grid of lengths and
+ * fractions, and -e runs only the named engine, e.g. -e integer_5.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MY_SIZE_T ptrdiff_t
+#include "../fastrank_sort.h"
+
+#define MIN_CELL_SECONDS  0.2
+#define MIN_REPS          5
+#define MAX_REPS          1000
+
+typedef struct {
+    const char *name;
+    int         is_double;
+    int         sort_method;
+} engine_t;
+
+static const engine_t engines[] = {
+    { "integer_1", 0, 1 }, { "integer_2", 0, 2 }, { "integer_3", 0, 3 },
+    { "integer_4", 0, 4 }, { "integer_5", 0, 5 }, { "integer_6", 0, 6 },
+    { "integer_7", 0, 7 },
+    { "double_1",  1, 1 }, { "double_5",  1, 5 }, { "double_6",  1, 6 },
+    { "double_7",  1, 7 }
+};
+#define N_ENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+typedef enum { ORD_RANDOM, ORD_SORTED, ORD_REVERSED, ORD_IDENTICAL,
+               ORD_ORGANPIPE } order_t;
+static const char *order_names[] = { "random", "sorted", "reversed",
+                                     "identical", "organpipe" };
+#define N_ORDERS 5
+
+/* the grids of benchmarking.R */
+static const double full_lengths[] = {
+    10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+    100000, 200000, 500000, 1000000
+};
+static const double full_fractions[] = {
+    10, 7, 5, 4, 3, 2, 1.7, 1.5, 1.3, 1.2, 1, 0.8, 0.7, 0.6, 0.5, 0.4, 0.3,
+    0.2, 0.1, 0.05
+};
+static const double quick_lengths[] = { 100, 10000, 1000000 };
+static const double quick_fractions[] = { 10, 1, 0.1 };
+
+static uint64_t rng_state = 20030131;
+
+static uint64_t xorshift64(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Fill v[0..n-1] as sample(round(n * fraction), n, fraction < 10), then
+ * arrange it in the given order */
+static void generate(int v[], const MY_SIZE_T n, const double fraction,
+                     const order_t order) {
+    MY_SIZE_T i;
+    if (order == ORD_IDENTICAL) {
+        for (i = 0; i < n; ++i)
+            v[i] = 1;
+        return;
+    }
+    uint64_t range = (uint64_t) llround(n * fraction);
+    if (range < 1)
+        range = 1;
+    if (fraction >= 10) {
+        /* without replacement: a partial Fisher-Yates shuffle of 1..range */
+        int *pool = (int *) malloc(range * sizeof(int));
+        for (uint64_t k = 0; k < range; ++k)
+            pool[k] = (int)(k + 1);
+        for (i = 0; i < n; ++i) {
+            uint64_t k = i + xorshift64() % (range - i);
+            int t = pool[i];
+            pool[i] = pool[k];
+            pool[k] = t;
+            v[i] = pool[i];
+        }
+        free(pool);
+    } else {
+        for (i = 0; i < n; ++i)
+            v[i] = (int)(1 + xorshift64() % range);
+    }
+    if (order == ORD_RANDOM)
+        return;
+    qsort(v, n, sizeof(int), cmp_int);
+    if (order == ORD_REVERSED) {
+        for (i = 0; i < n / 2; ++i) {
+            int t = v[i];
+            v[i] = v[n - 1 - i];
+            v[n - 1 - i] = t;
+        }
+    } else if (order == ORD_ORGANPIPE) {
+        /* increasing to the middle and decreasing after it */
+        int *t = (int *) malloc(n * sizeof(int));
+        for (i = 0; i < n; ++i)
+            t[(i % 2) ? n - 1 - i / 2 : i / 2] = v[i];
+        memcpy(v, t, n * sizeof(int));
+        free(t);
+    }
+}
+
+typedef enum { CELL_OK = 0, CELL_TIMEOUT, CELL_CRASH } cell_t;
+static const char *cell_names[] = { "ok", "timeout", "crash" };
+
+/* Time one cell, filling times[0..*reps-1].  Each run is given twice the
+ * limit before the process is killed by SIGALRM */
+static cell_t time_cell(const engine_t *e, const int vi[], const double vd[],
+                        MY_SIZE_T indx[], const MY_SIZE_T n, const double limit,
+                        double times[], int *reps) {
+    struct itimerval kill_after, disarm;
+    memset(&kill_after, 0, sizeof(kill_after));
+    memset(&disarm, 0, sizeof(disarm));
+    kill_after.it_value.tv_sec = (time_t)(2 * limit);
+    kill_after.it_value.tv_usec = (suseconds_t)(fmod(2 * limit, 1.0) * 1e6);
+    double total = 0;
+    int r;
+    for (r = 0; r < MAX_REPS; ++r) {
+        for (MY_SIZE_T i = 0; i < n; ++i)
+            indx[i] = i;
+        setitimer(ITIMER_REAL, &kill_after, NULL);
+        double t0 = now();
+        if (e->is_double)
+            fr_sort_double_(vd, indx, n, e->sort_method);
+        else
+            fr_sort_integer_(vi, indx, n, e->sort_method);
+        times[r] = now() - t0;
+        setitimer(ITIMER_REAL, &disarm, NULL);
+        total += times[r];
+        if (r == 0 && times[0] > limit) {
+            *reps = 1;
+            return CELL_TIMEOUT;
+        }
+        if (r + 1 >= MIN_REPS && total >= MIN_CELL_SECONDS)
+            break;
+    }
+    *reps = (r < MAX_REPS) ? r + 1 : MAX_REPS;
+    /* check the sort while we are here */
+    for (MY_SIZE_T i = 1; i < n; ++i)
+        if (e->is_double ? vd[indx[i - 1]] > vd[indx[i]]
+                         : vi[indx[i - 1]] > vi[indx[i]]) {
+            fprintf(stderr, "benchmark: %s failed to sort\n", e->name);
+            exit(1);
+        }
+    return CELL_OK;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = (char *) buf;
+    while (len > 0) {
+        ssize_t m = read(fd, p, len);
+        if (m <= 0)
+            return -1;
+        p += m;
+        len -= (size_t) m;
+    }
+    return 0;
+}
+
+/* Time one cell in a child process, which sends back its status, reps and
+ * times through a pipe, so a crash or a runaway run is contained */
+static cell_t time_cell_child(const engine_t *e, const int vi[],
+                              const double vd[], MY_SIZE_T indx[],
+                              const MY_SIZE_T n, const double limit,
+                              double times[], int *reps) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+        perror("benchmark: pipe");
+        exit(2);
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("benchmark: fork");
+        exit(2);
+    }
+    if (pid == 0) {
+        close(fd[0]);
+        int status = (int) time_cell(e, vi, vd, indx, n, limit, times, reps);
+        if (write(fd[1], &status, sizeof(int)) != sizeof(int)
+            || write(fd[1], reps, sizeof(int)) != sizeof(int)
+            || write(fd[1], times, *reps * sizeof(double))
+               != (ssize_t)(*reps * sizeof(double)))
+            _exit(1);
+        _exit(0);
+    }
+    close(fd[1]);
+    int status = CELL_CRASH, wstatus;
+    *reps = 0;
+    if (read_all(fd[0], &status, sizeof(int)) != 0
+        || read_all(fd[0], reps, sizeof(int)) != 0
+        || read_all(fd[0], times, *reps * sizeof(double)) != 0) {
+        status = CELL_CRASH;
+        *reps = 0;
+    }
+    close(fd[0]);
+    waitpid(pid, &wstatus, 0);
+    if (WIFSIGNALED(wstatus))
+        status = (WTERMSIG(wstatus) == SIGALRM) ? CELL_TIMEOUT : CELL_CRASH;
+    else if (! WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+        status = CELL_CRASH;
+    return (cell_t) status;
+}
+
+int main(int argc, char *argv[]) {
+    const double *lengths = full_lengths, *fractions = full_fractions;
+    int n_lengths = sizeof(full_lengths) / sizeof(double);
+    int n_fractions = sizeof(full_fractions) / sizeof(double);
+    const char *out_file = NULL, *only = NULL;
+    double limit = 2.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qo:t:s:e:h")) != -1) {
+        switch (opt) {
+        case 'q':
+            lengths = quick_lengths;
+            n_lengths = sizeof(quick_lengths) / sizeof(double);
+            fractions = quick_fractions;
+            n_fractions = sizeof(quick_fractions) / sizeof(double);
+            break;
+        case 'o': out_file = optarg; break;
+        case 't': limit = atof(optarg); break;
+        case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+        case 'e': only = optarg; break;
+        default:
+            fprintf(stderr, "Usage: benchmark [-q] [-o file] [-t seconds] "
+                            "[-s seed] [-e engine]\n");
+            return 2;
+        }
+    }
+    FILE *out = out_file ? fopen(out_file, "w") : stdout;
+    if (! out) {
+        fprintf(stderr, "benchmark: unable to open %s\n", out_file);
+        return 2;
+    }
+
+    MY_SIZE_T maxn = (MY_SIZE_T) lengths[n_lengths - 1];
+    int *vi = (int *) malloc(maxn * sizeof(int));
+    double *vd = (double *) malloc(maxn * sizeof(double));
+    MY_SIZE_T *indx = (MY_SIZE_T *) malloc(maxn * sizeof(MY_SIZE_T));
+    double *times = (double *) malloc(MAX_REPS * sizeof(double));
+    /* per engine, order and fraction, whether a shorter length timed out */
+    char *timed_out = (char *) calloc(N_ENGINES * N_ORDERS * n_fractions, 1);
+
+    time_t started = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&started));
+    fprintf(out, "{\n  \"benchmark\": \"fastrank sort kernels\",\n"
+                 "  \"timestamp\": \"%s\",\n"
+                 "  \"quicksort_insertion_cutoff\": %d,\n"
+                 "  \"time_limit\": %g,\n  \"results\": [", stamp,
+                 QUICKSORT_INSERTION_CUTOFF, limit);
+    int first = 1;
+    fprintf(stderr, "%-10s %-10s %8s %9s %6s %12s %12s %12s\n", "engine",
+            "order", "length", "fraction", "reps", "min_ns", "median_ns",
+            "p99_ns");
+
+    for (int il = 0; il < n_lengths; ++il) {
+        MY_SIZE_T n = (MY_SIZE_T) lengths[il];
+        for (int o = 0; o < N_ORDERS; ++o) {
+            /* the fraction makes no difference to identical values */
+            int nf = (o == ORD_IDENTICAL) ? 1 : n_fractions;
+            for (int f = 0; f < nf; ++f) {
+                generate(vi, n, fractions[f], (order_t) o);
+                for (MY_SIZE_T i = 0; i < n; ++i)
+                    vd[i] = vi[i] / 2.0;
+                for (int ie = 0; ie < N_ENGINES; ++ie) {
+                    const engine_t *e = &engines[ie];
+                    if (only && strcmp(only, e->name))
+                        continue;
+                    char *skip = &timed_out[(ie * N_ORDERS + o) * n_fractions + f];
+                    if (*skip)
+                        continue;
+                    int reps;
+                    cell_t status = time_cell_child(e, vi, vd, indx, n, limit,
+                                                    times, &reps);
+                    *skip = (status != CELL_OK);
+                    double tmin = NAN, tmed = NAN, tp99 = NAN;
+                    if (reps > 0) {
+                        qsort(times, reps, sizeof(double), cmp_double);
+                        tmin = times[0] * 1e9;
+                        tmed = times[reps / 2] * 1e9;
+                        tp99 = times[(int)(0.99 * (reps - 1))] * 1e9;
+                    }
+                    fprintf(out, "%s\n    {\"engine\": \"%s\", \"type\": \"%s\", "
+                            "\"sort_method\": %d, \"order\": \"%s\", "
+                            "\"length\": %ld, ", first ? "" : ",", e->name,
+                            e->is_double ? "double" : "integer",
+                            e->sort_method, order_names[o], (long) n);
+                    if (o == ORD_IDENTICAL)
+                        fprintf(out, "\"fraction\": null, ");
+                    else
+                        fprintf(out, "\"fraction\": %g, ", fractions[f]);
+                    fprintf(out, "\"reps\": %d, ", reps);
+                    if (reps > 0)
+                        fprintf(out, "\"min_ns\": %.0f, \"median_ns\": %.0f, "
+                                "\"p99_ns\": %.0f, ", tmin, tmed, tp99);
+                    else
+                        fprintf(out, "\"min_ns\": null, \"median_ns\": null, "
+                                "\"p99_ns\": null, ");
+                    fprintf(out, "\"status\": \"%s\"}", cell_names[status]);
+                    first = 0;
+                    fprintf(stderr, "%-10s %-10s %8ld %9g %6d %12.0f %12.0f %12.0f%s%s\n",
+                            e->name, order_names[o], (long) n,
+                            o == ORD_IDENTICAL ? NAN : fractions[f], reps,
+                            tmin, tmed, tp99, status ? "  " : "",
+                            status ? cell_names[status] : "");
+                }
+            }
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    free(vi);
+    free(vd);
+    free(indx);
+    free(times);
+    free(timed_out);
+    return 0;
+}